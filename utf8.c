@@ -1,7 +1,222 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* locale_t, newlocale and uselocale */
+#endif
+
 #include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <string.h>
 
 #include "utf8.h"
 
+#if defined(_WIN32)
+#include <io.h>
+#define utf8_sys_read(fd, p, n) _read((fd), (p), (unsigned int)(n))
+#define utf8_sys_write(fd, p, n) _write((fd), (p), (unsigned int)(n))
+#else
+#include <pthread.h>
+#include <unistd.h>
+#define utf8_sys_read(fd, p, n) read((fd), (p), (n))
+#define utf8_sys_write(fd, p, n) write((fd), (p), (n))
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* The SIMD kernels are compiled with per-function target attributes and */
+/* selected at run time, so the library still runs on any x86 processor. */
+#define UTF8_X86
+#include <immintrin.h>
+#endif
+
+#if defined(UTF8_X86)
+
+#define UTF8_CPU_SSE2 1
+#define UTF8_CPU_SSSE3 2
+#define UTF8_CPU_AVX2 4
+
+/*
+Returns the set of the instruction set extensions the SIMD kernels may use
+on the running processor. The value is computed once, the race between the
+threads calling it for the first time is harmless as all store the same 
+value.
+*/
+static int utf8_cpu(void)
+{
+    static int features = -1;
+    int found = __atomic_load_n(&features, __ATOMIC_RELAXED);
+    if (found >= 0) return found;
+    found = 0;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) found |= UTF8_CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3")) found |= UTF8_CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2")) found |= UTF8_CPU_AVX2;
+    __atomic_store_n(&features, found, __ATOMIC_RELAXED);
+    return found;
+}
+
+#endif
+
+#if defined(UTF8_STATS)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define UTF8_THREAD __declspec(thread)
+#else
+#define UTF8_THREAD __thread
+#endif
+
+/*
+Each thread counts in its own slot, found through a thread-local pointer, so
+the counters are incremented without atomic read-modify-write operations. 
+The slots are linked in a list which is never shortened: `utf8_stats_get` 
+adds all of them, and the slot of a thread which ended (on POSIX systems) is
+given with its counts to the next thread needing one. `utf8_stats_shared` is
+the slot of the threads which couldn't allocate their own.
+*/
+struct utf8_stats_slot {
+    utf8_stats counts;
+    long owned; /* a running thread counts in the slot */
+    struct utf8_stats_slot *next;
+};
+
+static struct utf8_stats_slot utf8_stats_shared = {{0}, 1, NULL};
+static struct utf8_stats_slot *utf8_stats_slots = &utf8_stats_shared;
+static UTF8_THREAD struct utf8_stats_slot *utf8_stats_mine;
+
+#if defined(_MSC_VER)
+
+#define utf8_stats_load(p) (*(p))
+#define utf8_stats_store(p, v) (*(p) = (v))
+#define utf8_stats_first() (utf8_stats_slots)
+
+static int utf8_stats_take(struct utf8_stats_slot *slot)
+{
+    return _InterlockedCompareExchange(&slot->owned, 1, 0) == 0;
+}
+
+static void utf8_stats_push(struct utf8_stats_slot *slot)
+{
+    do {
+        slot->next = utf8_stats_slots;
+    } while (_InterlockedCompareExchangePointer(
+        (void *volatile *)&utf8_stats_slots, slot, slot->next) != slot->next);
+}
+
+#else
+
+#define utf8_stats_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define utf8_stats_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define utf8_stats_first() __atomic_load_n(&utf8_stats_slots, __ATOMIC_ACQUIRE)
+
+static int utf8_stats_take(struct utf8_stats_slot *slot)
+{
+    long expected = 0;
+    return __atomic_compare_exchange_n(&slot->owned, &expected, 1, 0, 
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void utf8_stats_push(struct utf8_stats_slot *slot)
+{
+    slot->next = __atomic_load_n(&utf8_stats_slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&utf8_stats_slots, &slot->next, slot,
+        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#endif
+
+#if !defined(_WIN32)
+
+static pthread_key_t utf8_stats_key;
+static pthread_once_t utf8_stats_once = PTHREAD_ONCE_INIT;
+
+/* Gives back the slot of a thread which ends, keeping its counts. */
+static void utf8_stats_release(void *slot)
+{
+    __atomic_store_n(&((struct utf8_stats_slot *)slot)->owned, 0, 
+        __ATOMIC_RELEASE);
+}
+
+static void utf8_stats_init(void)
+{
+    pthread_key_create(&utf8_stats_key, utf8_stats_release);
+}
+
+#endif
+
+/* Returns the slot of the calling thread, taking one on the first call. */
+static struct utf8_stats_slot *utf8_stats_local(void)
+{
+    struct utf8_stats_slot *slot = utf8_stats_mine;
+    if (slot != NULL) return slot;
+    for (slot = utf8_stats_first(); slot != NULL; 
+        slot = slot->next) {
+        if (utf8_stats_take(slot)) break;
+    }
+    if (slot == NULL) {
+        slot = calloc(1, sizeof(*slot));
+        if (slot == NULL) return &utf8_stats_shared;
+        slot->owned = 1;
+        utf8_stats_push(slot);
+    }
+#if !defined(_WIN32)
+    pthread_once(&utf8_stats_once, utf8_stats_init);
+    pthread_setspecific(utf8_stats_key, slot);
+#endif
+    utf8_stats_mine = slot;
+    return slot;
+}
+
+/* Adds `n` to the counter at `p`, which only the calling thread changes. */
+static inline void utf8_stats_add(size_t *p, size_t n)
+{
+    utf8_stats_store(p, *p + n);
+}
+
+#define UTF8_COUNT(field, n) utf8_stats_add(&utf8_stats_local()->counts.field, \
+    (n))
+
+void utf8_stats_get(utf8_stats *stats)
+{
+    struct utf8_stats_slot *slot;
+    size_t *total = (size_t *)stats, *count, i;
+    memset(stats, 0, sizeof(*stats));
+    for (slot = utf8_stats_first(); slot != NULL; 
+        slot = slot->next) {
+        count = (size_t *)&slot->counts;
+        for (i = 0; i < sizeof(*stats) / sizeof(size_t); i++)
+            total[i] += utf8_stats_load(count + i);
+    }
+}
+
+void utf8_stats_reset(void)
+{
+    struct utf8_stats_slot *slot;
+    size_t *count, i;
+    for (slot = utf8_stats_first(); slot != NULL; 
+        slot = slot->next) {
+        count = (size_t *)&slot->counts;
+        for (i = 0; i < sizeof(utf8_stats) / sizeof(size_t); i++)
+            utf8_stats_store(count + i, 0);
+    }
+}
+
+#else
+
+#define UTF8_COUNT(field, n) ((void)0)
+
+void utf8_stats_get(utf8_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void utf8_stats_reset(void)
+{
+}
+
+#endif
+
+/* Sets `errno` to EILSEQ, counting the error. */
+#define UTF8_EILSEQ() (UTF8_COUNT(errors, 1), errno = EILSEQ)
+
 static struct {
     int32_t lo;
     int32_t hi;
@@ -13,9 +228,7 @@ static struct {
     {0x10000, 0x10ffff}
 };
 
-#if defined(_WIN32)
-
-/* This is needed on Windows where wchar_t is 16-bit. */
+/* UTF-16, also the wide characters on Windows where wchar_t is 16-bit. */
 static struct {
     int32_t lo;
     int32_t hi;
@@ -25,39 +238,293 @@ static struct {
     {0x10000, 0x10ffff}
 };
 
-#endif
+/*
+The decoder is a deterministic finite automaton (after Bjoern Hoehrmann, 
+"Flexible and Economical UTF-8 Decoder"). `utf8_class` maps every byte to 
+one of 12 classes and `utf8_transition` holds for every class the next 
+state of each of the 9 states, packed in 6-bit fields: a state is the 
+offset of its field, so the next state is a shift of a value which doesn't
+depend on the current state, keeping the table lookups out of the chain of
+dependent operations. The states are: 0 accept, 6 reject, 12 one byte left, 
+18 two bytes left, 24 after 0xe0, 30 after 0xed, 36 after 0xf0, 42 three 
+bytes left, 48 after 0xf4.
+The automaton accepts exactly the sequences in the ranges of the `utf8` 
+table, except the surrogates.
+*/
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 6
+
+static const uint8_t utf8_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x00 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x80 */
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, /* 0x90 */
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, /* 0xa0 */
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    8, 8, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, /* 0xc0 */
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    10, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 3, 3, /* 0xe0 */
+    11, 6, 6, 6, 5, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8 /* 0xf0 */
+};
+
+static const uint64_t utf8_transition[12] = {
+    UINT64_C(0x6186186186180), /* 0x00...0x7f */
+    UINT64_C(0x12486306300186), /* 0x80...0x8f */
+    UINT64_C(0x618618618618c), /* 0xc2...0xdf */
+    UINT64_C(0x6186186186192), /* 0xe1...0xec, 0xee, 0xef */
+    UINT64_C(0x618618618619e), /* 0xed */
+    UINT64_C(0x61861861861b0), /* 0xf4 */
+    UINT64_C(0x61861861861aa), /* 0xf1...0xf3 */
+    UINT64_C(0x649218c300186), /* 0xa0...0xbf */
+    UINT64_C(0x6186186186186), /* 0xc0, 0xc1, 0xf5...0xff */
+    UINT64_C(0x6492306300186), /* 0x90...0x9f */
+    UINT64_C(0x6186186186198), /* 0xe0 */
+    UINT64_C(0x61861861861a4) /* 0xf0 */
+};
+
+/*
+Feeds the byte `c` to the automaton in `state`, accumulating in `value` the
+bits of the code point.
+Returns the new state.
+*/
+static inline uint32_t utf8_step(uint32_t state, int32_t *value, 
+    unsigned char c)
+{
+    uint32_t type = utf8_class[c];
+    *value = state != UTF8_ACCEPT ? (int32_t)((0x3f & c) | (*value << 6)) : 
+        (int32_t)((0xff >> type) & c);
+    return (uint32_t)(utf8_transition[type] >> state) & 0x3f;
+}
+
+/*
+Like `utf8_decode`, inlined in the loops of the library.
+*/
+static inline size_t utf8_decode_dfa(int32_t *rune, const char *s, 
+    size_t n_bytes)
+{
+    uint32_t state = UTF8_ACCEPT;
+    int32_t value = 0;
+    size_t parsed = 0;
+    while (parsed < n_bytes) {
+        state = utf8_step(state, &value, (unsigned char)s[parsed++]);
+        if (state == UTF8_ACCEPT) {
+            if (rune != NULL) *rune = value;
+            UTF8_COUNT(decoded[parsed - 1], 1);
+            return parsed;
+        }
+        if (state == UTF8_REJECT) return 0;
+    }
+    return 0; /* not enough bytes left */
+}
 
 /*
 Writes at the address given by `rune` the code point obtained from parsing
 at most `n_bytes` characters of the zero-terminated string `s`.
 Returns the number of characters parsed.
 Returns 0 if the first characters within `n_bytes` don't form a valid UTF-8 
-sequence or the resulting code point is invalid.
+sequence or the resulting code point is invalid (the surrogate range is not
+valid).
 The source pointer `s` can't be NULL.
 */
 size_t utf8_decode(int32_t *rune, const char *s, size_t n_bytes)
 {
-    size_t n_cont = 0; /* number of continuation bytes */
-    int32_t first, value = 0;
-    if (n_bytes < 1 || (0xc0 & *s) == 0x80) return 0;
+    if (n_bytes < 1) return 0;
     if ((0x80 & *s) == 0) {
         if (rune != NULL) *rune = *s;
+        UTF8_COUNT(decoded[0], 1);
         return 1;
     }
-    first = s[0];
-    while (0x40 & first) {
-        n_cont++;
-        if (n_cont >= n_bytes) return 0; /* not enough bytes left */
-        if (n_cont >= 4) return 0; /* sequence too long */
-        if ((0xc0 & s[n_cont]) != 0x80) return 0; /* not a cont. byte */
-        value = (value << 6) | (0x3f & s[n_cont]);
-        first <<= 1;
-    }
-    value |= (0x7f & first) << (5 * n_cont);
-    n_bytes = n_cont + 1; /* reuse n_bytes to hold the sequence size */
-    if (utf8[n_bytes].hi < value || value < utf8[n_bytes].lo) return 0;
-    if (rune != NULL) *rune = value;
-    return n_bytes;
+    return utf8_decode_dfa(rune, s, n_bytes);
+}
+
+void utf8_decoder_init(utf8_decoder *decoder)
+{
+    decoder->state = UTF8_ACCEPT;
+    decoder->value = 0;
+    decoder->pending = 0;
+}
+
+size_t utf8_decoder_feed(utf8_decoder *decoder, const char *chunk, 
+    size_t len, int32_t *out, size_t cap, size_t *parsed)
+{
+    uint32_t state = decoder->state, last;
+    int32_t value = decoder->value;
+    size_t done = 0, used = 0, pending = decoder->pending;
+    if (parsed != NULL) *parsed = 0;
+    if (chunk == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (state == UTF8_REJECT) { /* met by the previous call */
+        utf8_decoder_init(decoder);
+        UTF8_EILSEQ();
+        return (size_t)-1;
+    }
+    if (out == NULL) cap = (size_t)-1;
+    while (used < len && done < cap) {
+        if (state == UTF8_ACCEPT && (0x80 & chunk[used]) == 0) {
+            if (out != NULL) out[done] = chunk[used];
+            used++;
+            done++;
+            continue;
+        }
+        last = state;
+        state = utf8_step(state, &value, (unsigned char)chunk[used]);
+        if (state == UTF8_ACCEPT) {
+            if (out != NULL) out[done] = value;
+            used++;
+            done++;
+            pending = 0;
+        } 
+        else if (state == UTF8_REJECT) {
+            /* the byte breaking a sequence may start the next one */
+            if (last == UTF8_ACCEPT) used++;
+            pending = 0;
+            break;
+        }
+        else {
+            used++;
+            pending++;
+        }
+    }
+    if (parsed != NULL) *parsed = used;
+    if (state == UTF8_REJECT && done == 0) {
+        utf8_decoder_init(decoder);
+        UTF8_EILSEQ();
+        return (size_t)-1;
+    }
+    decoder->state = state;
+    decoder->value = value;
+    decoder->pending = pending;
+    return done;
+}
+
+size_t utf8_decoder_pending(const utf8_decoder *decoder)
+{
+    /* an invalid sequence left to the next call */
+    if (decoder->state == UTF8_REJECT) return (size_t)-1;
+    return decoder->pending;
+}
+
+/*
+Returns the length of the run of ASCII characters other than the backslash,
+which copy unchanged through `utf8_of_ascii`, at the start of the `n_bytes`
+characters at `s`, skipping 8 characters at a time.
+*/
+static size_t utf8_plain_run_scalar(const char *s, size_t n_bytes)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    uint64_t word, x;
+    size_t i = 0;
+    while (n_bytes - i >= 8) {
+        memcpy(&word, s + i, 8);
+        x = word ^ (ones * '\\'); /* the backslashes become zeros */
+        if (((word | ((x - ones) & ~x)) & (ones * 0x80)) != 0) break;
+        i += 8;
+    }
+    while (i < n_bytes && (0x80 & s[i]) == 0 && s[i] != '\\') i++;
+    return i;
+}
+
+#if defined(UTF8_X86)
+
+__attribute__((target("sse2")))
+static size_t utf8_plain_run_sse2(const char *s, size_t n_bytes)
+{
+    const __m128i backslash = _mm_set1_epi8('\\');
+    __m128i x;
+    unsigned mask;
+    size_t i = 0;
+    while (n_bytes - i >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        /* the high bit of the bytes above 0x7f and of the backslashes */
+        mask = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(x, _mm_cmpeq_epi8(x, backslash)));
+        if (mask != 0) return i + (unsigned)__builtin_ctz(mask);
+        i += 16;
+    }
+    return i + utf8_plain_run_scalar(s + i, n_bytes - i);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_plain_run_avx2(const char *s, size_t n_bytes)
+{
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    __m256i x;
+    unsigned mask;
+    size_t i = 0;
+    while (n_bytes - i >= 32) {
+        x = _mm256_loadu_si256((const __m256i *)(s + i));
+        mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(x, _mm256_cmpeq_epi8(x, backslash)));
+        if (mask != 0) return i + (unsigned)__builtin_ctz(mask);
+        i += 32;
+    }
+    return i + utf8_plain_run_scalar(s + i, n_bytes - i);
+}
+
+#endif
+
+static size_t utf8_plain_run(const char *s, size_t n_bytes)
+{
+    size_t i = 0;
+#if defined(UTF8_X86)
+    int cpu = utf8_cpu();
+#endif
+    /* the short runs between the escapes end before a block is needed */
+    while (i < 8 && i < n_bytes && (0x80 & s[i]) == 0 && s[i] != '\\') i++;
+    if (i < 8) return i;
+#if defined(UTF8_X86)
+    if (n_bytes - i >= 32 && (cpu & UTF8_CPU_AVX2) != 0)
+        return i + utf8_plain_run_avx2(s + i, n_bytes - i);
+    if (n_bytes - i >= 16 && (cpu & UTF8_CPU_SSE2) != 0)
+        return i + utf8_plain_run_sse2(s + i, n_bytes - i);
+#endif
+    return i + utf8_plain_run_scalar(s + i, n_bytes - i);
+}
+
+/*
+Writes at the address given by `value` the number written with the 
+`n_digits` (at most 8) hexadecimal digits at `s`, parsed at once in the 
+bytes of a 64-bit word, the first digit in the lowest byte.
+Returns `n_digits`, or 0 if one of the characters isn't a hexadecimal digit.
+*/
+static size_t utf8_parse_hex(uint32_t *value, const char *s, size_t n_digits)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    const uint64_t high = ones * 0x80;
+    uint64_t word = 0, lower, digit, alpha;
+    unsigned char digits[8];
+    size_t i;
+    memset(digits, '0', 8); /* the missing digits are zeros */
+    memcpy(digits, s, n_digits);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&word, digits, 8);
+    (void)i;
+#else
+    for (i = 0; i < 8; i++) word |= (uint64_t)digits[i] << (8 * i);
+#endif
+    if ((word & high) != 0) return 0;
+    /* the high bit of `b + 0x80 - c` tells if the byte `b` is at least `c` */
+    lower = word | (ones * 0x20);
+    digit = (word + ones * (0x80 - '0')) & ~(word + ones * (0x80 - '9' - 1));
+    alpha = (lower + ones * (0x80 - 'a')) & ~(lower + ones * (0x80 - 'f' - 1));
+    if (((digit | alpha) & high) != high) return 0;
+    word = (word & (ones * 0x0f)) + ((alpha >> 7) & ones) * 9;
+    /* gather the nibbles, then the bytes, then the 16-bit halves */
+    word = ((word & UINT64_C(0x000f000f000f000f)) << 4) | 
+        ((word >> 8) & UINT64_C(0x000f000f000f000f));
+    word = ((word & UINT64_C(0x000000ff000000ff)) << 8) | 
+        ((word >> 16) & UINT64_C(0x000000ff000000ff));
+    word = ((word & 0xffff) << 16) | ((word >> 32) & 0xffff);
+    *value = (uint32_t)word >> (4 * (8 - n_digits));
+    return n_digits;
 }
 
 /*
@@ -71,7 +538,7 @@ The source pointer `s` can't be NULL.
 static size_t ucs4_decode_ascii(int32_t *rune, const char *s, size_t n_bytes)
 {
     size_t parsed = 0;
-    int32_t r = 0;
+    uint32_t r;
     if (n_bytes < 1 || (0x80 & *s) != 0) return 0;
     if (*s != '\\') {
         if (rune != NULL) *rune = *s;
@@ -100,20 +567,10 @@ static size_t ucs4_decode_ascii(int32_t *rune, const char *s, size_t n_bytes)
             return 1;
     }
     parsed += 1;
-    while (parsed < n_bytes) {
-        if ('0' <= s[parsed] && s[parsed] <= '9')
-            r = (r << 4) + (s[parsed] - '0');
-        else if ('a' <= s[parsed] && s[parsed] <= 'f')
-            r = (r << 4) + (s[parsed] - 'a' + 10);
-        else if ('A' <= s[parsed] && s[parsed] <= 'F')
-            r = (r << 4) + (s[parsed] - 'A' + 10);
-        else
-            return 0;
-        parsed += 1;
-    }
-    if (r < 0 || r > 0x10ffff || (0xd800 <= r && r <= 0xdfff)) return 0;
-    if (rune != NULL) *rune = r;
-    return parsed;
+    if (utf8_parse_hex(&r, s + parsed, n_bytes - parsed) == 0) return 0;
+    if (r > 0x10ffff || (0xd800 <= r && r <= 0xdfff)) return 0;
+    if (rune != NULL) *rune = (int32_t)r;
+    return n_bytes;
 }
 
 /*
@@ -125,37 +582,29 @@ Returns -1 if the end-of-file has been reached.
 The variable `errno` is set to EILSEQ if an invalid or incomplete sequence 
 was found, or to the last error code set by the standard library function 
 `fgetc`.
+The bytes of an invalid sequence are read up to the first byte which can't
+continue it (the maximal subpart), a lone byte being read if it can't start
+a sequence, so the next call starts with the byte that broke the sequence.
 */
 int32_t utf8_get_rune(FILE *input)
 {
-    size_t n_bytes, n_cont = 0; /* number of continuation bytes */
-    int read;
-    int32_t first, value = 0;
-    if ((first = fgetc(input)) == EOF) return -1;
-    if ((0xc0 & first) == 0x80) {
-        ungetc(first, input);
-        errno = EILSEQ;
-        return 0xfffd;
-    }
-    if ((0x80 & first) == 0) return first;
-    while (0x40 & first) {
-        read = fgetc(input);
-        n_cont++;
-        if (read == EOF || n_cont >= 4 || (0xc0 & read) != 0x80) {
-            ungetc(read, input);
-            errno = EILSEQ;
+    uint32_t state = UTF8_ACCEPT;
+    int32_t value = 0;
+    int read, n_read = 0;
+    while ((read = fgetc(input)) != EOF) {
+        if (n_read++ == 0 && (0x80 & read) == 0) return read;
+        state = utf8_step(state, &value, (unsigned char)read);
+        if (state == UTF8_ACCEPT) return value;
+        if (state == UTF8_REJECT) {
+            /* the byte breaking a sequence may start the next one */
+            if (n_read > 1) ungetc(read, input);
+            UTF8_EILSEQ();
             return 0xfffd;
         }
-        value = (value << 6) | (0x3f & read);
-        first <<= 1;
-    }
-    value |= (0x7f & first) << (5 * n_cont);
-    n_bytes = n_cont + 1;
-    if (utf8[n_bytes].hi < value || value < utf8[n_bytes].lo) {
-        errno = EILSEQ;
-        return 0xfffd;
     }
-    return value;
+    if (n_read == 0) return -1;
+    UTF8_EILSEQ(); /* incomplete sequence at the end of the file */
+    return 0xfffd;
 }
 
 /*
@@ -166,12 +615,13 @@ valid).
 */
 size_t utf8_encode(char *p, int32_t rune)
 {
-    size_t i, n_bytes = 0; /* number of bytes to be written */
-    while (n_bytes < sizeof(utf8)) {
-        if (utf8[n_bytes].lo <= rune && rune <= utf8[n_bytes].hi) break;
-        n_bytes++;
-    }
-    if (n_bytes < 1 || n_bytes >= sizeof(utf8)) return 0; /* invalid */
+    size_t i, n_bytes; /* number of bytes to be written */
+    /* one comparison per range boundary instead of scanning the table */
+    if (rune < utf8[1].lo || rune > utf8[4].hi) return 0; /* invalid */
+    if (utf8[0].lo <= rune && rune <= utf8[0].hi) return 0; /* surrogate */
+    n_bytes = 1 + (rune > utf8[1].hi) + (rune > utf8[2].hi) + 
+        (rune > utf8[3].hi);
+    UTF8_COUNT(encoded[n_bytes - 1], 1);
     if (p != NULL) {
         if (n_bytes == 1) {
             p[0] = rune;
@@ -191,386 +641,3773 @@ Puts in the writable stream `output` the UTF-8 bytes encoding `rune`.
 Returns the value of `rune` in the absence of error.
 Returns -1 if the operation fails. The `errno` variable is set to
 EILSEQ if `rune` isn't a valid code point or to the last error code set by
-the standard library function `fputc`.
+the standard library function `fwrite`.
 */
 int32_t utf8_put_rune(int32_t rune, FILE *output)
 {
-    size_t i, n_bytes = 0;
-    int32_t done = rune;
-    while (n_bytes < sizeof(utf8)) {
-        if (utf8[n_bytes].lo <= rune && rune <= utf8[n_bytes].hi) break;
-        n_bytes++;
-    }
-    if (n_bytes < 1 || n_bytes >= sizeof(utf8)) {
-        errno = EILSEQ;
+    size_t n_bytes;
+    /* encode in `cache` first, then write the sequence with a single call */
+    char cache[4];
+    n_bytes = utf8_encode(cache, rune);
+    if (n_bytes == 0) {
+        UTF8_EILSEQ();
         return -1;
     }
-    if (n_bytes == 1) {
-        if (fputc(rune, output) == EOF) return -1;
-    } else {
-        for (i = n_bytes - 1; i > 0; i--) {
-            if (fputc(0x80 | (0x3f & rune), output) == EOF) 
-                return -1;
-            rune >>= 6;
-        }
-        if (fputc((0xf00 >> n_bytes) | rune, output) == EOF) 
-            return -1;
-    }
-    return done;
+    if (fwrite(cache, 1, n_bytes, output) < n_bytes) return -1;
+    return rune;
 }
 
-#if defined(_WIN32)
-
 /*
-Writes at the address given by `rune` the code point obtained from parsing
-at most `n_wchars` UTF-16 wide characters of the zero-terminated string `p`.
-Returns the number of UTF-16 wide characters parsed.
-Returns 0 if the first wide characters within `n_wchars` don't form a valid 
-UTF-16 sequence or the resulting code point is invalid.
-The source pointer `p` can't be NULL.
+The counting kernels size the conversions without decoding. A valid UTF-8
+text holds one rune per byte that isn't a continuation byte (0x80...0xbf) 
+and one rune outside the BMP per 4-byte lead byte (0xf0...0xf4). A byte `b`
+is counted if `(int8_t)(b ^ flip) > above`.
 */
-static size_t utf16_decode(int32_t *rune, const wchar_t *p, size_t n_wchars)
+static size_t utf8_count_bytes_scalar(const char *s, size_t n_bytes, 
+    int flip, int above)
 {
-    int32_t value;
-    if (n_wchars < 1) return 0; /* not enough wide characters left */
-    if ((0xf800 & p[0]) != 0xd800) {
-        if (rune != NULL) *rune = 0xffff & p[0]; /* clear the high part */
-        return 1;
+    size_t i, found = 0;
+    for (i = 0; i < n_bytes; i++) 
+        found += (int8_t)((unsigned char)s[i] ^ flip) > above;
+    return found;
+}
+
+#if defined(UTF8_X86)
+
+__attribute__((target("sse2")))
+static size_t utf8_count_bytes_sse2(const char *s, size_t n_bytes, 
+    int flip, int above)
+{
+    const __m128i f = _mm_set1_epi8((char)flip);
+    const __m128i a = _mm_set1_epi8((char)above);
+    __m128i counts, total = _mm_setzero_si128();
+    uint64_t sums[2];
+    size_t i = 0, k;
+    while (n_bytes - i >= 16) {
+        counts = _mm_setzero_si128();
+        /* the 8-bit counters are added to the total before overflowing */
+        for (k = 0; k < 255 && n_bytes - i >= 16; k++, i += 16)
+            counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(_mm_xor_si128(
+                _mm_loadu_si128((const __m128i *)(s + i)), f), a));
+        total = _mm_add_epi64(total, 
+            _mm_sad_epu8(counts, _mm_setzero_si128()));
     }
-    if ((0xfc00 & p[0]) == 0xd800) {
-        if (n_wchars > 1 && (0xfc00 & p[1]) == 0xdc00) {
-            value = 0x3ff & p[0];
-            value = 0x10000 + ((value << 10) | (0x3ff & p[1]));
-            if (rune != NULL) *rune = value;
-            return 2;
-        }
+    _mm_storeu_si128((__m128i *)sums, total);
+    return (size_t)(sums[0] + sums[1]) + 
+        utf8_count_bytes_scalar(s + i, n_bytes - i, flip, above);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_count_bytes_avx2(const char *s, size_t n_bytes, 
+    int flip, int above)
+{
+    const __m256i f = _mm256_set1_epi8((char)flip);
+    const __m256i a = _mm256_set1_epi8((char)above);
+    __m256i counts, total = _mm256_setzero_si256();
+    uint64_t sums[4];
+    size_t i = 0, k;
+    while (n_bytes - i >= 32) {
+        counts = _mm256_setzero_si256();
+        for (k = 0; k < 255 && n_bytes - i >= 32; k++, i += 32)
+            counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(
+                _mm256_xor_si256(
+                    _mm256_loadu_si256((const __m256i *)(s + i)), f), a));
+        total = _mm256_add_epi64(total, 
+            _mm256_sad_epu8(counts, _mm256_setzero_si256()));
     }
-    return 0;
+    _mm256_storeu_si256((__m256i *)sums, total);
+    return (size_t)(sums[0] + sums[1] + sums[2] + sums[3]) + 
+        utf8_count_bytes_scalar(s + i, n_bytes - i, flip, above);
 }
 
 /*
-Writes at the address given by `p` the UTF-16 wide characters encoding `rune`.
-Returns the number of UTF-16 wide characters used, even if `p` is NULL.
-Returns 0 if `rune` is not a valid code point (the surrogate range is not
-valid).
+Returns the number of UTF-8 bytes encoding the 32-bit units at `p`, read 
+by blocks of 4 (the count of units read is stored in `done`), or (size_t)-1
+if one of them isn't a valid code point. The sizes are the ASCII count plus
+the number of units above 0x7f, 0x7ff and 0xffff.
 */
-static size_t utf16_encode(wchar_t *p, int32_t rune)
+__attribute__((target("sse2")))
+static size_t utf8_units_size_sse2(const void *p, size_t n, size_t *done)
 {
-    size_t n_wchars = 0;
-    while (n_wchars < sizeof(utf16)) {
-        if (utf16[n_wchars].lo <= rune && rune <= utf16[n_wchars].hi) break;
-        n_wchars++;
+    const __m128i surrogate = _mm_set1_epi32(0xd800);
+    __m128i x, extra, bad = _mm_setzero_si128();
+    uint32_t sums[4];
+    size_t i = 0, k, n_bytes = 0;
+    while (n - i >= 4) {
+        extra = _mm_setzero_si128();
+        /* each lane adds at most 3 per block */
+        for (k = 0; k < 65536 && n - i >= 4; k++, i += 4) {
+            x = _mm_loadu_si128((const __m128i *)((const int32_t *)p + i));
+            extra = _mm_sub_epi32(extra, 
+                _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7f)));
+            extra = _mm_sub_epi32(extra, 
+                _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7ff)));
+            extra = _mm_sub_epi32(extra, 
+                _mm_cmpgt_epi32(x, _mm_set1_epi32(0xffff)));
+            bad = _mm_or_si128(bad, _mm_or_si128(_mm_or_si128(
+                _mm_cmpgt_epi32(x, _mm_set1_epi32(0x10ffff)),
+                _mm_srai_epi32(x, 31)), _mm_cmpeq_epi32(
+                    _mm_and_si128(x, _mm_set1_epi32(~0x7ff)), surrogate)));
+        }
+        _mm_storeu_si128((__m128i *)sums, extra);
+        n_bytes += (size_t)sums[0] + sums[1] + sums[2] + sums[3];
     }
-    if (n_wchars < 1 || n_wchars >= sizeof(utf16)) return 0; /* invalid */
-    if (p != NULL) {
-        if (n_wchars == 1) {
-            p[0] = rune;
-        } else {
-            rune -= 0x10000;
-            p[1] = 0xdc00 | (0x3ff & rune);
-            rune >>= 10;
-            p[0] = 0xd800 | (0x3ff & rune);
+    *done = i;
+    if (_mm_movemask_epi8(bad) != 0) return (size_t)-1;
+    return n_bytes + i;
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_units_size_avx2(const void *p, size_t n, size_t *done)
+{
+    const __m256i surrogate = _mm256_set1_epi32(0xd800);
+    __m256i x, extra, bad = _mm256_setzero_si256();
+    uint32_t sums[8];
+    size_t i = 0, k, n_bytes = 0;
+    while (n - i >= 8) {
+        extra = _mm256_setzero_si256();
+        for (k = 0; k < 65536 && n - i >= 8; k++, i += 8) {
+            x = _mm256_loadu_si256(
+                (const __m256i *)((const int32_t *)p + i));
+            extra = _mm256_sub_epi32(extra, 
+                _mm256_cmpgt_epi32(x, _mm256_set1_epi32(0x7f)));
+            extra = _mm256_sub_epi32(extra, 
+                _mm256_cmpgt_epi32(x, _mm256_set1_epi32(0x7ff)));
+            extra = _mm256_sub_epi32(extra, 
+                _mm256_cmpgt_epi32(x, _mm256_set1_epi32(0xffff)));
+            /* above 0x10ffff as unsigned, negative runes included */
+            bad = _mm256_or_si256(bad, _mm256_or_si256(
+                _mm256_xor_si256(x, _mm256_min_epu32(x, 
+                    _mm256_set1_epi32(0x10ffff))), 
+                _mm256_cmpeq_epi32(_mm256_and_si256(x, 
+                    _mm256_set1_epi32(~0x7ff)), surrogate)));
         }
+        _mm256_storeu_si256((__m256i *)sums, extra);
+        n_bytes += (size_t)sums[0] + sums[1] + sums[2] + sums[3] + 
+            sums[4] + sums[5] + sums[6] + sums[7];
     }
-    return n_wchars;
+    *done = i;
+    if (!_mm256_testz_si256(bad, bad)) return (size_t)-1;
+    return n_bytes + i;
 }
 
-size_t utf8_to_wchars(wchar_t *buffer, const char *s, size_t count)
+#endif
+
+static size_t utf8_count_bytes(const char *s, size_t n_bytes, int flip, 
+    int above)
+{
+#if defined(UTF8_X86)
+    int cpu = utf8_cpu();
+    if (n_bytes >= 32 && (cpu & UTF8_CPU_AVX2) != 0)
+        return utf8_count_bytes_avx2(s, n_bytes, flip, above);
+    if (n_bytes >= 16 && (cpu & UTF8_CPU_SSE2) != 0)
+        return utf8_count_bytes_sse2(s, n_bytes, flip, above);
+#endif
+    return utf8_count_bytes_scalar(s, n_bytes, flip, above);
+}
+
+/*
+Returns the number of UTF-8 bytes encoding the longest prefix of the 32-bit
+units at `p` that can be sized by blocks (the count of units is stored in 
+`done`, 0 without SIMD), or (size_t)-1 if one of them isn't a valid code 
+point. The caller sizes the remaining units.
+*/
+static size_t utf8_units_size(const void *p, size_t n, size_t *done)
+{
+#if defined(UTF8_X86)
+    int cpu = utf8_cpu();
+    if (n >= 8 && (cpu & UTF8_CPU_AVX2) != 0)
+        return utf8_units_size_avx2(p, n, done);
+    if (n >= 4 && (cpu & UTF8_CPU_SSE2) != 0)
+        return utf8_units_size_sse2(p, n, done);
+#endif
+    (void)p;
+    (void)n;
+    *done = 0;
+    return 0;
+}
+
+size_t utf8_count_runes(const char *s, size_t n_bytes)
 {
-    int32_t rune;
-    size_t done = 0, parsed, rune_size;
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
-    wchar_t cache[2]; 
     if (s == NULL) {
         errno = EINVAL;
         return 0;
     }
-    if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = utf8_decode(&rune, s, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
-        }
-        rune_size = utf16_encode(cache, rune); /* encode to the cache */
-        if (rune_size > count - done) break;
-        if (buffer != NULL) { /* copy the cache */
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-        }
-        if (rune == 0) break;
-        s += parsed;
-        done += rune_size;
-    }
-    return done;
+    return utf8_count_bytes(s, n_bytes, 0, -65); /* not 0x80...0xbf */
 }
 
-size_t utf8_of_wchars(char *buffer, const wchar_t *p, size_t count)
+size_t utf8_wchars_needed(const char *s, size_t n_bytes)
 {
-    int32_t rune;
-    size_t done = 0, parsed, rune_size;
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
-    char cache[4];
-    if (p == NULL) {
+    size_t n_wchars;
+    if (s == NULL) {
         errno = EINVAL;
         return 0;
     }
-    if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = utf16_decode(&rune, p, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
-        }
-        rune_size = utf8_encode(cache, rune);
-        if (rune_size > count - done) break;
-        if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-            if (rune_size > 2) *buffer++ = cache[2];
-            if (rune_size > 3) *buffer++ = cache[3];
-        }
-        if (rune == 0) break;
-        p += parsed;
-        done += rune_size;
+    n_wchars = utf8_count_bytes(s, n_bytes, 0, -65);
+#if WCHAR_MAX <= 0xffff
+    /* the runes above 0xffff take a surrogate pair: 0xf0...0xff */
+    n_wchars += utf8_count_bytes(s, n_bytes, 0x80, 0x6f);
+#endif
+    return n_wchars;
+}
+
+/*
+The index records the byte offset (and optionally the UTF-16 offset) of 
+every `stride`-th rune. The runes are counted like `utf8_count_runes` does,
+each byte which isn't a continuation byte starting a rune, 64 bytes at a
+time with a mask of the bytes starting a rune.
+*/
+struct utf8_index {
+    size_t stride; /* the number of runes between two checkpoints */
+    size_t n_bytes; /* the number of bytes indexed */
+    size_t n_runes; /* the number of runes in the bytes indexed */
+    size_t n_units; /* the number of UTF-16 units of the runes */
+    size_t n_checkpoints;
+    size_t capacity; /* the number of checkpoints allocated */
+    size_t *bytes; /* the byte offset of the rune `stride` * i */
+    size_t *units; /* its UTF-16 offset, NULL if not recorded */
+};
+
+static unsigned utf8_popcount64(uint64_t mask)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_popcountll(mask);
+#else
+    mask -= (mask >> 1) & UINT64_C(0x5555555555555555);
+    mask = (mask & UINT64_C(0x3333333333333333)) + 
+        ((mask >> 2) & UINT64_C(0x3333333333333333));
+    mask = (mask + (mask >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    return (unsigned)((mask * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+/* Returns the position of the set bit of rank `k` (from 0) in `mask`. */
+static unsigned utf8_select64(uint64_t mask, unsigned k)
+{
+    unsigned i = 0;
+    while (k-- > 0) mask &= mask - 1;
+#if defined(__GNUC__)
+    i = (unsigned)__builtin_ctzll(mask);
+#else
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+#endif
+    return i;
+}
+
+#if defined(UTF8_X86)
+
+__attribute__((target("sse2")))
+static uint64_t utf8_mask_bytes_sse2(const char *s, int flip, int above)
+{
+    const __m128i f = _mm_set1_epi8((char)flip);
+    const __m128i a = _mm_set1_epi8((char)above);
+    uint64_t mask = 0;
+    int i;
+    for (i = 3; i >= 0; i--) {
+        mask = (mask << 16) | (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(
+            _mm_xor_si128(_mm_loadu_si128((const __m128i *)(s + 16 * i)), 
+                f), a));
+    }
+    return mask;
+}
+
+#endif
+
+/*
+Returns the mask of the bytes among the `n_bytes` (at most 64) at `s` 
+counted by `utf8_count_bytes`, bit `i` standing for `s[i]`.
+*/
+static uint64_t utf8_mask_bytes(const char *s, size_t n_bytes, int flip, 
+    int above)
+{
+    uint64_t mask = 0;
+    size_t i;
+#if defined(UTF8_X86)
+    if (n_bytes == 64 && (utf8_cpu() & UTF8_CPU_SSE2) != 0)
+        return utf8_mask_bytes_sse2(s, flip, above);
+#endif
+    for (i = 0; i < n_bytes; i++) {
+        if ((int8_t)((unsigned char)s[i] ^ flip) > above) 
+            mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+utf8_index *utf8_index_open(size_t stride, int flags)
+{
+    utf8_index *index;
+    if (stride == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    index = calloc(1, sizeof(*index));
+    if (index == NULL) return NULL;
+    index->stride = stride;
+    index->capacity = 16;
+    index->bytes = malloc(index->capacity * sizeof(size_t));
+    if ((flags & UTF8_INDEX_UTF16) != 0) 
+        index->units = malloc(index->capacity * sizeof(size_t));
+    if (index->bytes == NULL || 
+        ((flags & UTF8_INDEX_UTF16) != 0 && index->units == NULL)) {
+        utf8_index_close(index);
+        return NULL;
+    }
+    return index;
+}
+
+void utf8_index_close(utf8_index *index)
+{
+    if (index == NULL) return;
+    free(index->bytes);
+    free(index->units);
+    free(index);
+}
+
+/* Makes room for one more checkpoint. Returns 0, or -1 if out of memory. */
+static int utf8_index_grow(utf8_index *index)
+{
+    size_t *bytes, *units, capacity = index->capacity * 2;
+    if (index->n_checkpoints < index->capacity) return 0;
+    bytes = realloc(index->bytes, capacity * sizeof(size_t));
+    if (bytes == NULL) return -1;
+    index->bytes = bytes;
+    if (index->units != NULL) {
+        units = realloc(index->units, capacity * sizeof(size_t));
+        if (units == NULL) return -1;
+        index->units = units;
+    }
+    index->capacity = capacity;
+    return 0;
+}
+
+int utf8_index_extend(utf8_index *index, const char *s, size_t n_bytes)
+{
+    uint64_t starts, longs = 0;
+    size_t pos, size, rune, k;
+    unsigned n_starts, bit;
+    if (index == NULL || s == NULL || n_bytes < index->n_bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+    pos = index->n_bytes;
+    while (pos < n_bytes) {
+        size = n_bytes - pos < 64 ? n_bytes - pos : 64;
+        starts = utf8_mask_bytes(s + pos, size, 0, -65);
+        n_starts = utf8_popcount64(starts);
+        /* the 4-byte lead bytes, whose runes take two UTF-16 units */
+        if (index->units != NULL) 
+            longs = utf8_mask_bytes(s + pos, size, 0x80, 0x6f);
+        /* the checkpoints falling in the block */
+        rune = index->n_checkpoints * index->stride;
+        while (rune - index->n_runes < n_starts) {
+            if (utf8_index_grow(index) != 0) return -1;
+            k = rune - index->n_runes;
+            bit = utf8_select64(starts, (unsigned)k);
+            index->bytes[index->n_checkpoints] = pos + bit;
+            if (index->units != NULL) {
+                index->units[index->n_checkpoints] = index->n_units + k + 
+                    utf8_popcount64(longs & (((uint64_t)1 << bit) - 1));
+            }
+            index->n_checkpoints++;
+            rune += index->stride;
+        }
+        index->n_runes += n_starts;
+        index->n_units += n_starts + utf8_popcount64(longs);
+        pos += size;
+        index->n_bytes = pos;
+    }
+    return 0;
+}
+
+size_t utf8_index_runes(const utf8_index *index)
+{
+    if (index == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    return index->n_runes;
+}
+
+size_t utf8_index_byte_of_rune(const utf8_index *index, const char *s, 
+    size_t rune)
+{
+    uint64_t starts;
+    size_t k, pos, size, left;
+    unsigned n_starts;
+    if (index == NULL || s == NULL || rune > index->n_runes) {
+        errno = EINVAL;
+        return (size_t)-1;
+    }
+    if (rune == index->n_runes) return index->n_bytes;
+    k = rune / index->stride;
+    pos = index->bytes[k];
+    left = rune - k * index->stride;
+    /* the rune exists, so it's found before the end of the bytes indexed */
+    while (1) {
+        size = index->n_bytes - pos < 64 ? index->n_bytes - pos : 64;
+        starts = utf8_mask_bytes(s + pos, size, 0, -65);
+        n_starts = utf8_popcount64(starts);
+        if (left < n_starts) return pos + utf8_select64(starts, (unsigned)left);
+        left -= n_starts;
+        pos += size;
+    }
+}
+
+size_t utf8_index_rune_of_byte(const utf8_index *index, const char *s, 
+    size_t byte)
+{
+    size_t lo = 0, hi, mid;
+    if (index == NULL || s == NULL || byte > index->n_bytes) {
+        errno = EINVAL;
+        return (size_t)-1;
+    }
+    if (byte == index->n_bytes) return index->n_runes;
+    if (index->n_checkpoints == 0 || index->bytes[0] > byte) return 0;
+    /* the last checkpoint at or before `byte` */
+    hi = index->n_checkpoints;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (index->bytes[mid] <= byte) lo = mid;
+        else hi = mid;
+    }
+    return lo * index->stride - 1 + utf8_count_bytes(s + index->bytes[lo], 
+        byte + 1 - index->bytes[lo], 0, -65);
+}
+
+size_t utf8_index_utf16_of_rune(const utf8_index *index, const char *s, 
+    size_t rune)
+{
+    size_t k, pos;
+    if (index == NULL || index->units == NULL) {
+        errno = EINVAL;
+        return (size_t)-1;
+    }
+    pos = utf8_index_byte_of_rune(index, s, rune);
+    if (pos == (size_t)-1) return (size_t)-1;
+    if (rune == index->n_runes) return index->n_units;
+    k = rune / index->stride;
+    return index->units[k] + (rune - k * index->stride) + 
+        utf8_count_bytes(s + index->bytes[k], pos - index->bytes[k], 
+            0x80, 0x6f);
+}
+
+/*
+Encodes the `n` runes at `src` in `dst`, stopping at the first invalid rune.
+Stores in `done` the number of runes encoded and returns the number of bytes
+written.
+*/
+static size_t utf8_encode_runes_scalar(char *dst, const int32_t *src, 
+    size_t n, size_t *done)
+{
+    size_t i, rune_size, n_bytes = 0;
+    for (i = 0; i < n; i++) {
+        if ((src[i] & ~0x7f) == 0) {
+            dst[n_bytes++] = (char)src[i];
+            continue;
+        }
+        rune_size = utf8_encode(dst + n_bytes, src[i]);
+        if (rune_size == 0) break;
+        n_bytes += rune_size;
+    }
+    *done = i;
+    return n_bytes;
+}
+
+#if defined(UTF8_X86)
+
+/*
+The SIMD encoder reads 8 runes at a time. ASCII runes are packed to bytes.
+Runes below U+0800 are built as 1 or 2 bytes in 16-bit lanes and runes below
+U+10000 as 1, 2 or 3 bytes in 32-bit lanes, then the unused bytes of the 
+lanes are squeezed out by a shuffle selected by the lengths of the runes. 
+The blocks holding 4-byte runes or invalid runes are encoded by 
+`utf8_encode`.
+*/
+
+/* the shuffle packing four 16-bit lanes, indexed by the 2-byte lanes */
+static const int8_t utf8_pack_2[16][8] = {
+    {0, 2, 4, 6, -1, -1, -1, -1},
+    {0, 1, 2, 4, 6, -1, -1, -1},
+    {0, 2, 3, 4, 6, -1, -1, -1},
+    {0, 1, 2, 3, 4, 6, -1, -1},
+    {0, 2, 4, 5, 6, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, -1, -1},
+    {0, 2, 3, 4, 5, 6, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1},
+    {0, 2, 4, 6, 7, -1, -1, -1},
+    {0, 1, 2, 4, 6, 7, -1, -1},
+    {0, 2, 3, 4, 6, 7, -1, -1},
+    {0, 1, 2, 3, 4, 6, 7, -1},
+    {0, 2, 4, 5, 6, 7, -1, -1},
+    {0, 1, 2, 4, 5, 6, 7, -1},
+    {0, 2, 3, 4, 5, 6, 7, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7}
+};
+
+/* the shuffle packing four 32-bit lanes, indexed by the lengths in base 3 */
+static const int8_t utf8_pack_3[81][16] = {
+    {0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 12, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, -1, -1, -1, -1, -1},
+    {0, 4, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 12, 13, 14, -1, -1, -1, -1, -1},
+    {0, 4, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 4, 5, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1},
+    {0, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1, -1},
+    {0, 1, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, -1},
+    {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1}
+};
+
+/* the base 3 index of `utf8_pack_3` for a mask of 4 lanes */
+static const uint8_t utf8_pack_3_index[16] = {
+    0, 1, 3, 4, 9, 10, 12, 13, 27, 28, 30, 31, 36, 37, 39, 40
+};
+
+/*
+Writes at `p` the 1, 2 or 3 bytes encoding each of the 4 runes below U+10000
+(surrogates excluded) held by `x`, storing 16 bytes. Returns the number of
+bytes used.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_encode_3_ssse3(char *p, __m128i x)
+{
+    const __m128i cont = _mm_set1_epi32(0x80);
+    const __m128i mask = _mm_set1_epi32(0x3f);
+    __m128i one, two, three, m1, m2, lanes;
+    int b1, b2;
+    one = x;
+    two = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi32(x, 6), _mm_set1_epi32(0xc0)),
+        _mm_slli_epi32(_mm_or_si128(_mm_and_si128(x, mask), cont), 8));
+    three = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi32(x, 12), _mm_set1_epi32(0xe0)),
+        _mm_or_si128(
+            _mm_slli_epi32(_mm_or_si128(
+                _mm_and_si128(_mm_srli_epi32(x, 6), mask), cont), 8),
+            _mm_slli_epi32(_mm_or_si128(_mm_and_si128(x, mask), cont), 16)));
+    m1 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7f));
+    m2 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7ff));
+    lanes = _mm_or_si128(_mm_and_si128(m1, two), _mm_andnot_si128(m1, one));
+    lanes = _mm_or_si128(_mm_and_si128(m2, three), 
+        _mm_andnot_si128(m2, lanes));
+    b1 = _mm_movemask_ps(_mm_castsi128_ps(m1));
+    b2 = _mm_movemask_ps(_mm_castsi128_ps(m2));
+    lanes = _mm_shuffle_epi8(lanes, _mm_loadu_si128((const __m128i *)
+        utf8_pack_3[utf8_pack_3_index[b1] + utf8_pack_3_index[b2]]));
+    _mm_storeu_si128((__m128i *)p, lanes);
+    return 4 + __builtin_popcount(b1) + __builtin_popcount(b2);
+}
+
+/*
+Writes at `p` the 1 or 2 bytes encoding each of the 8 runes below U+0800 
+held by the 16-bit lanes of `v`, storing 16 bytes at most. Returns the 
+number of bytes used.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_encode_2_ssse3(char *p, __m128i v)
+{
+    __m128i lanes, m, shuffle;
+    size_t n_bytes;
+    int bits;
+    /* 2-byte sequences built in 16-bit lanes, 4 lanes per half */
+    lanes = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16(0xc0)),
+        _mm_slli_epi16(_mm_or_si128(
+            _mm_and_si128(v, _mm_set1_epi16(0x3f)), 
+            _mm_set1_epi16(0x80)), 8));
+    m = _mm_cmpgt_epi16(v, _mm_set1_epi16(0x7f));
+    lanes = _mm_or_si128(_mm_and_si128(m, lanes), _mm_andnot_si128(m, v));
+    bits = _mm_movemask_epi8(_mm_packs_epi16(m, _mm_setzero_si128()));
+    shuffle = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i *)utf8_pack_2[bits & 15]),
+        _mm_add_epi8(_mm_loadl_epi64((const __m128i *)
+            utf8_pack_2[bits >> 4]), _mm_set1_epi8(8)));
+    lanes = _mm_shuffle_epi8(lanes, shuffle);
+    _mm_storel_epi64((__m128i *)p, lanes);
+    n_bytes = 4 + __builtin_popcount(bits & 15);
+    _mm_storel_epi64((__m128i *)(p + n_bytes), 
+        _mm_unpackhi_epi64(lanes, lanes));
+    return n_bytes + 4 + __builtin_popcount(bits >> 4);
+}
+
+__attribute__((target("ssse3")))
+static size_t utf8_encode_runes_ssse3(char *dst, const int32_t *src, 
+    size_t n, size_t *done)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, v;
+    size_t i = 0, k, rune_size, n_bytes = 0;
+    int bits;
+    /* 
+    The stores may write up to 12 bytes past the bytes encoding a block, 
+    which are overwritten by the 16 runes at least following it.
+    */
+    while (n - i >= 8 + 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + i));
+        b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+        v = _mm_or_si128(a, b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_and_si128(v, _mm_set1_epi32(~0x7f)), zero)) == 0xffff) {
+            v = _mm_packus_epi16(_mm_packs_epi32(a, b), zero);
+            _mm_storel_epi64((__m128i *)(dst + n_bytes), v);
+            n_bytes += 8;
+            i += 8;
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_and_si128(v, _mm_set1_epi32(~0x7ff)), zero)) == 0xffff) {
+            n_bytes += utf8_encode_2_ssse3(dst + n_bytes, 
+                _mm_packs_epi32(a, b));
+            i += 8;
+            continue;
+        }
+        for (k = 0; k < 2; k++) {
+            v = _mm_loadu_si128((const __m128i *)(src + i));
+            if (_mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpgt_epi32(v, _mm_set1_epi32(0xffff)),
+                _mm_or_si128(_mm_cmplt_epi32(v, zero),
+                    _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf800)), 
+                        _mm_set1_epi32(0xd800))))) == 0) {
+                n_bytes += utf8_encode_3_ssse3(dst + n_bytes, v);
+                i += 4;
+                continue;
+            }
+            /* 4-byte sequences or invalid runes */
+            for (bits = 0; bits < 4; bits++) {
+                rune_size = utf8_encode(dst + n_bytes, src[i]);
+                if (rune_size == 0) {
+                    *done = i;
+                    return n_bytes;
+                }
+                n_bytes += rune_size;
+                i += 1;
+            }
+        }
+    }
+    n_bytes += utf8_encode_runes_scalar(dst + n_bytes, src + i, n - i, &k);
+    *done = i + k;
+    return n_bytes;
+}
+
+#endif
+
+/*
+Encodes the `n` runes at `src` in `dst`, which must have room for the
+encoded bytes, stopping at the first invalid rune.
+Stores in `done` the number of runes encoded and returns the number of bytes
+written.
+*/
+static size_t utf8_encode_runes_n(char *dst, const int32_t *src, size_t n,
+    size_t *done)
+{
+#if defined(UTF8_X86)
+    if (n >= 8 + 16 && (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        return utf8_encode_runes_ssse3(dst, src, n, done);
+#endif
+    return utf8_encode_runes_scalar(dst, src, n, done);
+}
+
+size_t utf8_encode_runes(char *dst, const int32_t *src, size_t n)
+{
+    size_t i, rune_size, n_bytes = 0;
+    if (src == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (dst == NULL) {
+        n_bytes = utf8_units_size(src, n, &i);
+        if (n_bytes == (size_t)-1) {
+            UTF8_EILSEQ();
+            return (size_t)-1;
+        }
+        for (; i < n; i++) {
+            rune_size = utf8_encode(NULL, src[i]);
+            if (rune_size == 0) {
+                UTF8_EILSEQ();
+                return (size_t)-1;
+            }
+            n_bytes += rune_size;
+        }
+        return n_bytes;
+    }
+    n_bytes = utf8_encode_runes_n(dst, src, n, &i);
+    if (i < n) {
+        UTF8_EILSEQ();
+        return (size_t)-1;
+    }
+    return n_bytes;
+}
+
+/* the size of the buffer used by `utf8_reader` */
+#define UTF8_READER_SIZE 65536
+
+struct utf8_reader {
+    FILE *file; /* the stream read, NULL when reading from `fd` */
+    int fd;
+    int eof; /* the end of the input (or a read error) has been reached */
+    int error; /* the error code of the failed read, 0 if none */
+    size_t start; /* the first byte not yet parsed */
+    size_t end; /* the end of the bytes read */
+    char buffer[UTF8_READER_SIZE];
+};
+
+/*
+Returns the number of bytes `utf8_get_rune` skips when the `n_bytes` 
+characters at `s` start with an invalid sequence: the longest start of a
+valid sequence (the maximal subpart), or at least the first byte.
+*/
+static size_t utf8_invalid_size(const char *s, size_t n_bytes)
+{
+    uint32_t state = UTF8_ACCEPT;
+    int32_t value = 0;
+    size_t size = 0;
+    while (size < n_bytes) {
+        state = utf8_step(state, &value, (unsigned char)s[size]);
+        if (state == UTF8_REJECT) break;
+        size++;
+    }
+    return size > 0 ? size : 1;
+}
+
+static utf8_reader *utf8_reader_new(FILE *input, int fd)
+{
+    utf8_reader *reader = (utf8_reader *)malloc(sizeof(utf8_reader));
+    if (reader == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    reader->file = input;
+    reader->fd = fd;
+    reader->eof = 0;
+    reader->error = 0;
+    reader->start = 0;
+    reader->end = 0;
+    return reader;
+}
+
+utf8_reader *utf8_reader_open(FILE *input)
+{
+    if (input == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return utf8_reader_new(input, -1);
+}
+
+utf8_reader *utf8_reader_open_fd(int fd)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    return utf8_reader_new(NULL, fd);
+}
+
+void utf8_reader_close(utf8_reader *reader)
+{
+    free(reader);
+}
+
+int utf8_reader_error(const utf8_reader *reader)
+{
+    return reader->error;
+}
+
+/*
+Moves the bytes not yet parsed to the start of the buffer of `reader` and
+reads until at least 4 bytes (the longest sequence) are available or the
+end of the input is reached.
+*/
+static void utf8_reader_fill(utf8_reader *reader)
+{
+    size_t got, left = reader->end - reader->start;
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, left);
+        reader->start = 0;
+        reader->end = left;
+    }
+    while (!reader->eof && reader->end < 4) {
+        if (reader->file != NULL) {
+            got = fread(reader->buffer + reader->end, 1, 
+                UTF8_READER_SIZE - reader->end, reader->file);
+            if (got == 0) {
+                reader->eof = 1;
+                if (ferror(reader->file)) reader->error = errno;
+            }
+        } else {
+            got = (size_t)utf8_sys_read(reader->fd, 
+                reader->buffer + reader->end, 
+                UTF8_READER_SIZE - reader->end);
+            if (got == (size_t)-1) {
+                if (errno == EINTR) continue;
+                reader->eof = 1;
+                reader->error = errno;
+                got = 0;
+            } else if (got == 0) {
+                reader->eof = 1;
+            }
+        }
+        reader->end += got;
+    }
+}
+
+/*
+Parses the next rune from the buffer of `reader`, which must hold at least
+4 bytes or all the bytes left in the input.
+*/
+static int32_t utf8_reader_parse(utf8_reader *reader)
+{
+    int32_t rune;
+    size_t parsed, left = reader->end - reader->start;
+    const char *s = reader->buffer + reader->start;
+    parsed = utf8_decode_dfa(&rune, s, left);
+    if (parsed == 0) {
+        reader->start += utf8_invalid_size(s, left);
+        UTF8_EILSEQ();
+        return 0xfffd;
+    }
+    reader->start += parsed;
+    return rune;
+}
+
+int32_t utf8_reader_next(utf8_reader *reader)
+{
+    if (reader->end - reader->start < 4) {
+        utf8_reader_fill(reader);
+        if (reader->start == reader->end) {
+            if (reader->error != 0) errno = reader->error;
+            return -1;
+        }
+    }
+    if ((0x80 & reader->buffer[reader->start]) == 0)
+        return reader->buffer[reader->start++];
+    return utf8_reader_parse(reader);
+}
+
+size_t utf8_reader_read_runes(utf8_reader *reader, int32_t *out, size_t n)
+{
+    size_t done = 0, last;
+    const char *s;
+    while (done < n) {
+        if (reader->end - reader->start < 4) {
+            utf8_reader_fill(reader);
+            if (reader->start == reader->end) {
+                if (reader->error != 0) errno = reader->error;
+                break;
+            }
+        }
+        /* parse without checking the buffer for the bytes surely there */
+        last = reader->end - reader->start < 4 ? reader->start + 1 : 
+            reader->end - 3;
+        s = reader->buffer;
+        while (done < n && reader->start < last) {
+            if ((0x80 & s[reader->start]) == 0)
+                out[done++] = s[reader->start++];
+            else
+                out[done++] = utf8_reader_parse(reader);
+        }
+    }
+    return done;
+}
+
+/* the size of the buffer used by `utf8_writer` */
+#define UTF8_WRITER_SIZE 65536
+
+struct utf8_writer {
+    FILE *file; /* the stream written, NULL when writing to `fd` */
+    int fd;
+    int error; /* the error code of the failed write, 0 if none */
+    size_t end; /* the end of the bytes not yet written */
+    char buffer[UTF8_WRITER_SIZE];
+};
+
+static utf8_writer *utf8_writer_new(FILE *output, int fd)
+{
+    utf8_writer *writer = (utf8_writer *)malloc(sizeof(utf8_writer));
+    if (writer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    writer->file = output;
+    writer->fd = fd;
+    writer->error = 0;
+    writer->end = 0;
+    return writer;
+}
+
+utf8_writer *utf8_writer_open(FILE *output)
+{
+    if (output == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return utf8_writer_new(output, -1);
+}
+
+utf8_writer *utf8_writer_open_fd(int fd)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    return utf8_writer_new(NULL, fd);
+}
+
+int utf8_writer_error(const utf8_writer *writer)
+{
+    return writer->error;
+}
+
+/*
+Writes the buffered bytes of `writer` to its stream or file descriptor, 
+with a single call unless the file descriptor accepts only a part.
+Returns 0, or -1 if writing failed.
+*/
+static int utf8_writer_drain(utf8_writer *writer)
+{
+    size_t put, done = 0;
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    if (writer->file != NULL) {
+        done = fwrite(writer->buffer, 1, writer->end, writer->file);
+        if (done < writer->end) writer->error = errno != 0 ? errno : EIO;
+    } else {
+        while (done < writer->end) {
+            put = (size_t)utf8_sys_write(writer->fd, writer->buffer + done, 
+                writer->end - done);
+            if (put == (size_t)-1) {
+                if (errno == EINTR) continue;
+                writer->error = errno;
+                break;
+            }
+            done += put;
+        }
+    }
+    writer->end = 0;
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    return 0;
+}
+
+int utf8_writer_flush(utf8_writer *writer)
+{
+    if (utf8_writer_drain(writer) != 0) return -1;
+    if (writer->file != NULL && fflush(writer->file) == EOF) {
+        writer->error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int utf8_writer_close(utf8_writer *writer)
+{
+    int result = utf8_writer_flush(writer);
+    free(writer);
+    return result;
+}
+
+int32_t utf8_writer_put_rune(utf8_writer *writer, int32_t rune)
+{
+    size_t rune_size;
+    if (UTF8_WRITER_SIZE - writer->end < 4 && utf8_writer_drain(writer) != 0)
+        return -1;
+    if (writer->error != 0) {
+        errno = writer->error;
+        return -1;
+    }
+    rune_size = utf8_encode(writer->buffer + writer->end, rune);
+    if (rune_size == 0) {
+        UTF8_EILSEQ();
+        return -1;
+    }
+    writer->end += rune_size;
+    return rune;
+}
+
+size_t utf8_writer_put_runes(utf8_writer *writer, const int32_t *runes, 
+    size_t n)
+{
+    size_t last, encoded, done = 0;
+    if (writer->error != 0) {
+        errno = writer->error;
+        return 0;
+    }
+    while (done < n) {
+        if (UTF8_WRITER_SIZE - writer->end < 4 && 
+            utf8_writer_drain(writer) != 0) break;
+        /* encode in bulk the runes surely fitting in the room left */
+        last = done + (UTF8_WRITER_SIZE - writer->end) / 4;
+        if (last > n) last = n;
+        writer->end += utf8_encode_runes_n(writer->buffer + writer->end, 
+            runes + done, last - done, &encoded);
+        done += encoded;
+        if (done < last) {
+            UTF8_EILSEQ();
+            break;
+        }
+    }
+    return done;
+}
+
+/*
+Returns the length of the longest prefix of the `n_bytes` characters at `s`
+made only of complete and valid UTF-8 sequences, using `utf8_decode` for the
+non-ASCII sequences and skipping the ASCII characters a word at a time.
+*/
+static size_t utf8_validate_scalar(const char *s, size_t n_bytes)
+{
+    size_t parsed, done = 0;
+    uint64_t word;
+    while (done < n_bytes) {
+        if (n_bytes - done >= 8) {
+            memcpy(&word, s + done, 8);
+            if ((word & UINT64_C(0x8080808080808080)) == 0) {
+                done += 8;
+                continue;
+            }
+        }
+        if ((0x80 & s[done]) == 0) {
+            done += 1;
+            continue;
+        }
+        parsed = utf8_decode_dfa(NULL, s + done, n_bytes - done);
+        if (parsed == 0) break;
+        done += parsed;
+    }
+    return done;
+}
+
+/*
+Returns the offset where `utf8_validate_scalar` must restart after a SIMD 
+kernel found an error in the block beginning at `done`: the error can belong
+to a sequence started at most three bytes before the block, and all the 
+blocks before were valid, so the lead byte of that sequence is found by 
+skipping back over the continuation bytes.
+*/
+static size_t utf8_validate_restart(const char *s, size_t done)
+{
+    size_t k;
+    unsigned char c;
+    for (k = 1; k < 4 && k <= done; k++) {
+        c = s[done - k];
+        if ((0xc0 & c) == 0x80) continue;
+        if ((0x80 & c) == 0) break;
+        /* a lead byte, check whether its sequence ends before the block */
+        if (k < (c >= 0xf0 ? 4u : c >= 0xe0 ? 3u : 2u)) return done - k;
+        break;
+    }
+    return done;
+}
+
+#if defined(UTF8_X86)
+
+/*
+The SIMD validation classifies every pair of adjacent bytes with three 
+16-entry tables indexed by the high and the low nibble of the first byte and 
+by the high nibble of the second byte. A pair is invalid when the three 
+classes share a bit. The sequences longer than two bytes are checked by
+requiring a continuation byte two and three bytes after the 3-byte and the 
+4-byte lead bytes (Keiser and Lemire, "Validating UTF-8 In Less Than One
+Instruction Per Byte").
+*/
+#define UTF8_TOO_SHORT (1 << 0) /* lead byte not followed by a cont. byte */
+#define UTF8_TOO_LONG (1 << 1) /* ASCII followed by a continuation byte */
+#define UTF8_OVERLONG_3 (1 << 2) /* 0xe0 followed by 0x80...0x9f */
+#define UTF8_TOO_LARGE (1 << 3) /* 0xf4 followed by 0x90...0xbf */
+#define UTF8_SURROGATE (1 << 4) /* 0xed followed by 0xa0...0xbf */
+#define UTF8_OVERLONG_2 (1 << 5) /* 0xc0 or 0xc1 */
+#define UTF8_TOO_LARGE_1000 (1 << 6) /* 0xf5...0xff followed by 0x80...0x8f */
+#define UTF8_OVERLONG_4 (1 << 6) /* 0xf0 followed by 0x80...0x8f */
+#define UTF8_TWO_CONTS (1 << 7) /* cont. byte following a cont. byte */
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const int8_t utf8_class_1_high[16] = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    (int8_t)UTF8_TWO_CONTS, (int8_t)UTF8_TWO_CONTS, 
+    (int8_t)UTF8_TWO_CONTS, (int8_t)UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const int8_t utf8_class_1_low[16] = {
+    (int8_t)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+    (int8_t)(UTF8_CARRY | UTF8_OVERLONG_2),
+    (int8_t)UTF8_CARRY,
+    (int8_t)UTF8_CARRY,
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | 
+        UTF8_SURROGATE),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+    (int8_t)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+};
+
+static const int8_t utf8_class_2_high[16] = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    (int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | 
+        UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+    (int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | 
+        UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+    (int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | 
+        UTF8_SURROGATE | UTF8_TOO_LARGE),
+    (int8_t)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | 
+        UTF8_SURROGATE | UTF8_TOO_LARGE),
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* the largest values allowed in the last three bytes of a complete block */
+static const uint8_t utf8_block_end[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+__attribute__((target("ssse3")))
+static __m128i utf8_check_ssse3(__m128i input, __m128i prev)
+{
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1, prev2, prev3, c1h, c1l, c2h, must23;
+    prev1 = _mm_alignr_epi8(input, prev, 15);
+    c1h = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)utf8_class_1_high),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    c1l = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)utf8_class_1_low),
+        _mm_and_si128(prev1, low_nibble));
+    c2h = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)utf8_class_2_high),
+        _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    prev2 = _mm_alignr_epi8(input, prev, 14);
+    prev3 = _mm_alignr_epi8(input, prev, 13);
+    must23 = _mm_or_si128(
+        _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80))),
+        _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80))));
+    must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, 
+        _mm_and_si128(_mm_and_si128(c1h, c1l), c2h));
+}
+
+__attribute__((target("ssse3")))
+static size_t utf8_validate_ssse3(const char *s, size_t n_bytes)
+{
+    const __m128i block_end = 
+        _mm_loadu_si128((const __m128i *)(utf8_block_end + 16));
+    __m128i input, error, prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    size_t done = 0;
+    while (n_bytes - done >= 16) {
+        input = _mm_loadu_si128((const __m128i *)(s + done));
+        if (_mm_movemask_epi8(input) == 0) {
+            error = incomplete;
+            incomplete = _mm_setzero_si128();
+        } else {
+            error = utf8_check_ssse3(input, prev);
+            incomplete = _mm_subs_epu8(input, block_end);
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, 
+            _mm_setzero_si128())) != 0xffff) break;
+        prev = input;
+        done += 16;
+    }
+    done = utf8_validate_restart(s, done);
+    return done + utf8_validate_scalar(s + done, n_bytes - done);
+}
+
+__attribute__((target("avx2")))
+static __m256i utf8_check_avx2(__m256i input, __m256i prev)
+{
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    __m256i carry, prev1, prev2, prev3, c1h, c1l, c2h, must23;
+    carry = _mm256_permute2x128_si256(prev, input, 0x21);
+    prev1 = _mm256_alignr_epi8(input, carry, 15);
+    prev2 = _mm256_alignr_epi8(input, carry, 14);
+    prev3 = _mm256_alignr_epi8(input, carry, 13);
+    c1h = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_class_1_high)),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    c1l = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_class_1_low)),
+        _mm256_and_si256(prev1, low_nibble));
+    c2h = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_class_2_high)),
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    must23 = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80))),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80))));
+    must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, 
+        _mm256_and_si256(_mm256_and_si256(c1h, c1l), c2h));
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_validate_avx2(const char *s, size_t n_bytes)
+{
+    const __m256i block_end = 
+        _mm256_loadu_si256((const __m256i *)utf8_block_end);
+    __m256i input, error, prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    size_t done = 0;
+    while (n_bytes - done >= 32) {
+        input = _mm256_loadu_si256((const __m256i *)(s + done));
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = incomplete;
+            incomplete = _mm256_setzero_si256();
+        } else {
+            error = utf8_check_avx2(input, prev);
+            incomplete = _mm256_subs_epu8(input, block_end);
+        }
+        if (!_mm256_testz_si256(error, error)) break;
+        prev = input;
+        done += 32;
+    }
+    done = utf8_validate_restart(s, done);
+    return done + utf8_validate_scalar(s + done, n_bytes - done);
+}
+
+#endif
+
+/*
+Returns the length of the longest prefix of the `n_bytes` characters at `s`
+made only of complete and valid UTF-8 sequences, that is `n_bytes` when the
+whole input is valid.
+Uses the widest SIMD kernel supported by the processor. Unlike 
+`utf8_validate`, doesn't set `errno` nor count an error, the callers probing
+their input before converting it.
+*/
+static size_t utf8_valid_prefix(const char *s, size_t n_bytes)
+{
+#if defined(UTF8_X86)
+    if (n_bytes >= 64 && (utf8_cpu() & UTF8_CPU_AVX2))
+        return utf8_validate_avx2(s, n_bytes);
+    if (n_bytes >= 32 && (utf8_cpu() & UTF8_CPU_SSSE3))
+        return utf8_validate_ssse3(s, n_bytes);
+#endif
+    return utf8_validate_scalar(s, n_bytes);
+}
+
+size_t utf8_validate(const char *s, size_t n_bytes)
+{
+    size_t done;
+    if (s == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    done = utf8_valid_prefix(s, n_bytes);
+    if (done < n_bytes) UTF8_EILSEQ();
+    return done;
+}
+
+/*
+Writes at the address given by `rune` the code point obtained from parsing
+at most `n_units` UTF-16 units at `p`.
+Returns the number of UTF-16 units parsed.
+Returns 0 if the first units within `n_units` don't form a valid UTF-16 
+sequence or the resulting code point is invalid.
+The source pointer `p` can't be NULL.
+*/
+static size_t utf16_decode(int32_t *rune, const uint16_t *p, size_t n_units)
+{
+    int32_t value;
+    if (n_units < 1) return 0; /* not enough units left */
+    if ((0xf800 & p[0]) != 0xd800) {
+        if (rune != NULL) *rune = p[0];
+        return 1;
+    }
+    if ((0xfc00 & p[0]) == 0xd800) {
+        if (n_units > 1 && (0xfc00 & p[1]) == 0xdc00) {
+            value = 0x3ff & p[0];
+            value = 0x10000 + ((value << 10) | (0x3ff & p[1]));
+            if (rune != NULL) *rune = value;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+/*
+Writes at the address given by `p` the UTF-16 units encoding `rune`.
+Returns the number of UTF-16 units used, even if `p` is NULL.
+Returns 0 if `rune` is not a valid code point (the surrogate range is not
+valid).
+*/
+static size_t utf16_encode(uint16_t *p, int32_t rune)
+{
+    size_t n_units;
+    if (rune < utf16[1].lo || rune > utf16[2].hi) return 0; /* invalid */
+    if (utf16[0].lo <= rune && rune <= utf16[0].hi) return 0; /* surrogate */
+    n_units = 1 + (rune > utf16[1].hi);
+    if (p != NULL) {
+        if (n_units == 1) {
+            p[0] = (uint16_t)rune;
+        } else {
+            rune -= 0x10000;
+            p[1] = (uint16_t)(0xdc00 | (0x3ff & rune));
+            rune >>= 10;
+            p[0] = (uint16_t)(0xd800 | (0x3ff & rune));
+        }
+    }
+    return n_units;
+}
+
+#if defined(UTF8_X86)
+
+/*
+The UTF-16 kernels convert a block at a time while the block is ASCII, or
+holds runes of a few lengths only: ASCII and 2-byte sequences (in 8 bytes),
+3-byte sequences (4 in 12 bytes) or 4-byte sequences (4 in 16 bytes) on the
+UTF-8 side, runes below U+0800 or BMP runes (8 units) on the UTF-16 side. A
+block which doesn't fit converts its first rune alone, then the next block 
+is tried.
+*/
+
+/* the shuffle spreading 8 bytes to 16-bit lanes, indexed by the lead bytes */
+static const int8_t utf8_spread_2[128][16] = {
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, -1, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, 7, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, -1, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, -1, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, -1, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, -1, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, -1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1},
+    {0, -1, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1},
+    {0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1}
+};
+
+/* the shuffle spreading four 3-byte sequences to 32-bit lanes */
+static const int8_t utf8_spread_3[16] = {
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+};
+
+/* the shuffle keeping the low half of four 32-bit lanes */
+static const int8_t utf8_low_halves[16] = {
+    0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/*
+Decodes to the 16-bit lanes of `value` the ASCII characters and the 2-byte
+sequences (0xc2...0xdf then 0x80...0xbf) held by the 8 low bytes of `x`, 
+storing in `n_runes` the number of runes. A sequence started by the last 
+byte is left to the next block.
+Returns the number of bytes decoded, 0 if the bytes hold other sequences.
+*/
+__attribute__((target("ssse3")))
+static inline size_t utf8_decode_2_ssse3(__m128i x, __m128i *value, 
+    size_t *n_runes)
+{
+    __m128i lanes, two, m;
+    unsigned high, lead, cont;
+    high = (unsigned)_mm_movemask_epi8(x) & 0xff;
+    lead = high & (unsigned)_mm_movemask_epi8(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8(-65)));
+    cont = high & ~lead;
+    /* no lead byte above 0xdf, no 0xc0 or 0xc1 */
+    if (((unsigned)_mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8(-33)),
+        _mm_cmpeq_epi8(_mm_and_si128(x, _mm_set1_epi8(-2)), 
+            _mm_set1_epi8(-64)))) & lead & 0x7f) != 0) return 0;
+    if (cont != (lead & 0x7f) << 1) return 0;
+    lanes = _mm_shuffle_epi8(x, _mm_loadu_si128(
+        (const __m128i *)utf8_spread_2[lead & 0x7f]));
+    two = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(lanes, 
+        _mm_set1_epi16(0x1f)), 6), _mm_and_si128(
+        _mm_srli_epi16(lanes, 8), _mm_set1_epi16(0x3f)));
+    /* the lanes of 2-byte sequences end with a negative byte */
+    m = _mm_cmplt_epi16(lanes, _mm_setzero_si128());
+    *value = _mm_or_si128(_mm_and_si128(m, two), _mm_andnot_si128(m, lanes));
+    *n_runes = 8 - (lead >> 7) - (size_t)__builtin_popcount(cont);
+    return 8 - (lead >> 7);
+}
+
+/*
+Decodes to the 32-bit lanes of `value` the four 3-byte sequences held by 
+the 12 low bytes of `x`.
+Returns 12, or 0 if the bytes hold other sequences, overlong sequences or
+surrogates.
+*/
+__attribute__((target("ssse3")))
+static inline size_t utf8_decode_3_ssse3(__m128i x, __m128i *value)
+{
+    __m128i lanes, runes;
+    lanes = _mm_shuffle_epi8(x, 
+        _mm_loadu_si128((const __m128i *)utf8_spread_3));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(lanes, 
+        _mm_set1_epi32(0xc0c0f0)), _mm_set1_epi32(0x8080e0))) != 0xffff)
+        return 0;
+    runes = _mm_or_si128(_mm_or_si128(
+        _mm_slli_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0x0f)), 12),
+        _mm_srli_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0x3f00)), 2)),
+        _mm_srli_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0x3f0000)), 16));
+    /* the range of utf8[3], less the surrogates of utf8[0] */
+    if (_mm_movemask_epi8(_mm_or_si128(
+        _mm_cmplt_epi32(runes, _mm_set1_epi32(0x800)), _mm_cmpeq_epi32(
+            _mm_and_si128(runes, _mm_set1_epi32(0xf800)), 
+            _mm_set1_epi32(0xd800)))) != 0) return 0;
+    *value = runes;
+    return 12;
+}
+
+/*
+Decodes to the 32-bit lanes of `value` the four 4-byte sequences held by 
+`x`.
+Returns 16, or 0 if the bytes hold other sequences, overlong sequences or 
+runes above U+10FFFF.
+*/
+__attribute__((target("ssse3")))
+static inline size_t utf8_decode_4_ssse3(__m128i x, __m128i *value)
+{
+    __m128i runes;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(x, 
+        _mm_set1_epi32((int)0xc0c0c0f8)), 
+        _mm_set1_epi32((int)0x808080f0))) != 0xffff) return 0;
+    runes = _mm_or_si128(_mm_or_si128(
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x07)), 18),
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x3f00)), 4)),
+        _mm_or_si128(
+        _mm_srli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x3f0000)), 10),
+        _mm_srli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x3f000000)), 24)));
+    /* the range of utf8[4] */
+    if (_mm_movemask_epi8(_mm_or_si128(
+        _mm_cmplt_epi32(runes, _mm_set1_epi32(0x10000)),
+        _mm_cmpgt_epi32(runes, _mm_set1_epi32(0x10ffff)))) != 0) return 0;
+    *value = runes;
+    return 16;
+}
+
+/*
+Converts to UTF-16 at `dst` the UTF-8 bytes at `s` while 16 bytes are left
+and there's room for 16 units in the `room` units at `dst`, stopping before
+an invalid sequence. A block giving fewer units than its vector holds goes 
+through `part`, so nothing is written past the units converted. Stores in 
+`used` the number of bytes converted and returns the number of units 
+written.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_to_utf16_ssse3(uint16_t *dst, const char *s, 
+    size_t n_bytes, size_t room, size_t *used)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x, value;
+    uint32_t state;
+    int32_t rune = 0;
+    uint16_t part[16], *out;
+    size_t i = 0, done = 0, start, run, n_runes;
+    unsigned high;
+    while (n_bytes - i >= 16 && room - done >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        high = (unsigned)_mm_movemask_epi8(x);
+        run = (high & 0xff) != 0 ? utf8_decode_2_ssse3(x, &value, &n_runes)
+            : 0;
+        if (run != 0) {
+            out = n_runes == 8 ? dst + done : part;
+            _mm_storeu_si128((__m128i *)out, value);
+            if (out == part) memcpy(dst + done, part, n_runes * sizeof(*part));
+            i += run;
+            done += n_runes;
+            continue;
+        }
+        while (high == 0 && n_bytes - i >= 32 && room - done >= 32) {
+            /* a run of ASCII blocks */
+            _mm_storeu_si128((__m128i *)(dst + done), 
+                _mm_unpacklo_epi8(x, zero));
+            _mm_storeu_si128((__m128i *)(dst + done + 8), 
+                _mm_unpackhi_epi8(x, zero));
+            i += 16;
+            done += 16;
+            UTF8_COUNT(ascii_bytes, 16);
+            x = _mm_loadu_si128((const __m128i *)(s + i));
+            high = (unsigned)_mm_movemask_epi8(x);
+        }
+        if ((high & 1) == 0) {
+            /* widen the 16 bytes, keep the ASCII ones */
+            run = high == 0 ? 16 : (size_t)__builtin_ctz(high);
+            out = run == 16 ? dst + done : part;
+            _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(x, zero));
+            _mm_storeu_si128((__m128i *)(out + 8), _mm_unpackhi_epi8(x, zero));
+            if (out == part) memcpy(dst + done, part, run * sizeof(*part));
+            i += run;
+            done += run;
+            UTF8_COUNT(ascii_bytes, run);
+            continue;
+        }
+        if (utf8_decode_3_ssse3(x, &value) != 0) {
+            _mm_storel_epi64((__m128i *)(dst + done), _mm_shuffle_epi8(value,
+                _mm_loadu_si128((const __m128i *)utf8_low_halves)));
+            i += 12;
+            done += 4;
+            continue;
+        }
+        if (utf8_decode_4_ssse3(x, &value) != 0) {
+            /* written as surrogate pairs */
+            value = _mm_sub_epi32(value, _mm_set1_epi32(0x10000));
+            _mm_storeu_si128((__m128i *)(dst + done), _mm_or_si128(
+                _mm_or_si128(_mm_srli_epi32(value, 10), 
+                _mm_set1_epi32(0xdc00d800)), _mm_slli_epi32(
+                _mm_and_si128(value, _mm_set1_epi32(0x3ff)), 16)));
+            i += 16;
+            done += 8;
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = i;
+        state = utf8_step(UTF8_ACCEPT, &rune, (unsigned char)s[i++]);
+        while (state > UTF8_REJECT)
+            state = utf8_step(state, &rune, (unsigned char)s[i++]);
+        if (state != UTF8_ACCEPT) {
+            i = start;
+            break;
+        }
+        done += utf16_encode(dst + done, rune);
+    }
+    *used = i;
+    return done;
+}
+
+/*
+Converts to UTF-8 at `dst` the UTF-16 units at `p` while 8 units are left
+and there's room for 32 bytes in the `room` bytes at `dst`, stopping before
+an invalid unit. The encoders store whole vectors, so the blocks are encoded
+in `part` and only their bytes are copied to `dst`. Stores in `used` the 
+number of units converted and returns the number of bytes written.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_of_utf16_ssse3(char *dst, const uint16_t *p, 
+    size_t n_units, size_t room, size_t *used)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+    int32_t rune;
+    char part[32];
+    size_t i = 0, n_bytes = 0, size;
+    while (n_units - i >= 8 && room - n_bytes >= 32) {
+        x = _mm_loadu_si128((const __m128i *)(p + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(x, 
+            _mm_set1_epi16((short)0xff80)), zero)) == 0xffff) {
+            _mm_storel_epi64((__m128i *)(dst + n_bytes), 
+                _mm_packus_epi16(x, zero));
+            n_bytes += 8;
+            i += 8;
+            UTF8_COUNT(ascii_bytes, 8);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(x, 
+            _mm_set1_epi16((short)0xf800)), zero)) == 0xffff) {
+            size = utf8_encode_2_ssse3(part, x);
+            memcpy(dst + n_bytes, part, size);
+            n_bytes += size;
+            i += 8;
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(x, 
+            _mm_set1_epi16((short)0xf800)), 
+            _mm_set1_epi16((short)0xd800))) == 0) {
+            size = utf8_encode_3_ssse3(part, _mm_unpacklo_epi16(x, zero));
+            size += utf8_encode_3_ssse3(part + size, 
+                _mm_unpackhi_epi16(x, zero));
+            memcpy(dst + n_bytes, part, size);
+            n_bytes += size;
+            i += 8;
+            continue;
+        }
+        /* a block holding surrogates */
+        size = utf16_decode(&rune, p + i, n_units - i);
+        if (size == 0) break;
+        n_bytes += utf8_encode(dst + n_bytes, rune);
+        i += size;
+    }
+    *used = i;
+    return n_bytes;
+}
+
+/*
+Returns the number of UTF-8 bytes encoding the UTF-16 units at `p` read by
+blocks of 8 (the count of units read is stored in `done`). Each unit takes
+1 byte, plus 1 above 0x7f and 1 above 0x7ff, less 1 for a surrogate. The 
+blocks must pair their surrogates, a pair cut at the end of the last block
+being left to the caller.
+*/
+__attribute__((target("sse2")))
+static size_t utf8_utf16_size_sse2(const uint16_t *p, size_t n, size_t *done)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i surrogate = _mm_set1_epi16((short)0xfc00);
+    __m128i x;
+    size_t i = 0, n_bytes = 0;
+    unsigned above_7f, above_7ff, high, low, carry = 0;
+    while (n - i >= 8) {
+        x = _mm_loadu_si128((const __m128i *)(p + i));
+        /* 2 mask bits per unit */
+        above_7f = 0xffff ^ (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(x, _mm_set1_epi16((short)0xff80)), zero));
+        above_7ff = 0xffff ^ (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(x, _mm_set1_epi16((short)0xf800)), zero));
+        high = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(x, surrogate), _mm_set1_epi16((short)0xd800)));
+        low = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(x, surrogate), _mm_set1_epi16((short)0xdc00)));
+        /* each low surrogate follows a high one */
+        if ((((high << 2) | carry) & 0xffff) != low) break;
+        carry = high >> 14;
+        n_bytes += 8 + ((size_t)__builtin_popcount(above_7f) + 
+            (size_t)__builtin_popcount(above_7ff) - 
+            (size_t)__builtin_popcount(high | low)) / 2;
+        i += 8;
+    }
+    if (carry != 0) { /* the high surrogate ending the blocks */
+        i -= 1;
+        n_bytes -= 2;
+    }
+    *done = i;
+    return n_bytes;
+}
+
+#endif
+
+/*
+Returns the number of UTF-8 bytes encoding the `n` UTF-16 units at `p`, or
+(size_t)-1 if they aren't valid UTF-16.
+*/
+static size_t utf8_utf16_size(const uint16_t *p, size_t n)
+{
+    int32_t rune;
+    size_t i = 0, n_bytes = 0, size;
+#if defined(UTF8_X86)
+    if (n >= 8 && (utf8_cpu() & UTF8_CPU_SSE2) != 0)
+        n_bytes = utf8_utf16_size_sse2(p, n, &i);
+#endif
+    while (i < n) {
+        if (p[i] < 0x80) {
+            n_bytes += 1;
+            i += 1;
+            continue;
+        }
+        size = utf16_decode(&rune, p + i, n - i);
+        if (size == 0) return (size_t)-1;
+        n_bytes += utf8_encode(NULL, rune);
+        i += size;
+    }
+    return n_bytes;
+}
+
+size_t utf8_to_utf16(uint16_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    int32_t rune;
+    size_t done = 0, used = 0, rune_size, n_units;
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    uint16_t cache[2];
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL && utf8_valid_prefix(s, n_bytes) == n_bytes) {
+        /* one unit per rune, two for the runes above 0xffff: 0xf0...0xff */
+        if (parsed != NULL) *parsed = n_bytes;
+        return utf8_count_bytes(s, n_bytes, 0, -65) + 
+            utf8_count_bytes(s, n_bytes, 0x80, 0x6f);
+    }
+    if (buffer == NULL) count = (size_t)-1;
+#if defined(UTF8_X86)
+    if (buffer != NULL && n_bytes >= 16 && count >= 16 && 
+        (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        done = utf8_to_utf16_ssse3(buffer, s, n_bytes, count, &used);
+#endif
+    while (used < n_bytes && done < count) {
+        if ((0x80 & s[used]) == 0) {
+            if (buffer != NULL) buffer[done] = (uint16_t)s[used];
+            used += 1;
+            done += 1;
+            continue;
+        }
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        n_units = utf16_encode(cache, rune); /* encode to the cache */
+        if (n_units > count - done) break;
+        if (buffer != NULL) { /* copy the cache */
+            buffer[done] = cache[0];
+            if (n_units > 1) buffer[done + 1] = cache[1];
+        }
+        used += rune_size;
+        done += n_units;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_of_utf16(char *buffer, const uint16_t *p, size_t n_units,
+    size_t count, size_t *parsed)
+{
+    int32_t rune;
+    size_t done = 0, used = 0, n_used, rune_size;
+    char cache[4];
+    if (p == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) {
+        done = utf8_utf16_size(p, n_units);
+        if (done != (size_t)-1) {
+            if (parsed != NULL) *parsed = n_units;
+            return done;
+        }
+        done = 0; /* convert up to the invalid unit */
+        count = (size_t)-1;
+    }
+#if defined(UTF8_X86)
+    if (buffer != NULL && n_units >= 8 && count >= 32 && 
+        (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        done = utf8_of_utf16_ssse3(buffer, p, n_units, count, &used);
+#endif
+    while (used < n_units && done < count) {
+        n_used = utf16_decode(&rune, p + used, n_units - used);
+        if (n_used == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        rune_size = utf8_encode(cache, rune);
+        if (rune_size > count - done) break;
+        if (buffer != NULL) memcpy(buffer + done, cache, rune_size);
+        used += n_used;
+        done += rune_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+#if defined(UTF8_X86)
+
+/*
+Decodes to `dst` the UTF-8 bytes at `s` while 16 bytes are left and there's
+room for 16 runes in the `room` runes at `dst`, a block at a time like the
+UTF-16 kernels, stopping before an invalid sequence. Nothing is written past
+the runes decoded: a block giving fewer runes than its vector holds goes 
+through `part`. Stores in `used` the number of bytes decoded and returns the
+number of runes written.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_decode_runes_ssse3(int32_t *dst, const char *s, 
+    size_t n_bytes, size_t room, size_t *used)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x, half, value;
+    uint32_t state;
+    int32_t rune = 0, part[16], *out;
+    size_t i = 0, done = 0, start, run, n_runes;
+    unsigned high;
+    while (n_bytes - i >= 16 && room - done >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        high = (unsigned)_mm_movemask_epi8(x);
+        run = (high & 0xff) != 0 ? utf8_decode_2_ssse3(x, &value, &n_runes)
+            : 0;
+        if (run != 0) {
+            out = n_runes == 8 ? dst + done : part;
+            _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(value, zero));
+            _mm_storeu_si128((__m128i *)(out + 4), 
+                _mm_unpackhi_epi16(value, zero));
+            if (out == part) memcpy(dst + done, part, n_runes * sizeof(*part));
+            i += run;
+            done += n_runes;
+            continue;
+        }
+        while (high == 0 && n_bytes - i >= 32 && room - done >= 32) {
+            /* a run of ASCII blocks */
+            half = _mm_unpacklo_epi8(x, zero);
+            _mm_storeu_si128((__m128i *)(dst + done), 
+                _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(dst + done + 4), 
+                _mm_unpackhi_epi16(half, zero));
+            half = _mm_unpackhi_epi8(x, zero);
+            _mm_storeu_si128((__m128i *)(dst + done + 8), 
+                _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(dst + done + 12), 
+                _mm_unpackhi_epi16(half, zero));
+            i += 16;
+            done += 16;
+            UTF8_COUNT(ascii_bytes, 16);
+            x = _mm_loadu_si128((const __m128i *)(s + i));
+            high = (unsigned)_mm_movemask_epi8(x);
+        }
+        if ((high & 1) == 0) {
+            /* widen the 16 bytes, keep the ASCII ones */
+            run = high == 0 ? 16 : (size_t)__builtin_ctz(high);
+            out = run == 16 ? dst + done : part;
+            half = _mm_unpacklo_epi8(x, zero);
+            _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(out + 4), 
+                _mm_unpackhi_epi16(half, zero));
+            half = _mm_unpackhi_epi8(x, zero);
+            _mm_storeu_si128((__m128i *)(out + 8), 
+                _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(out + 12), 
+                _mm_unpackhi_epi16(half, zero));
+            if (out == part) memcpy(dst + done, part, run * sizeof(*part));
+            i += run;
+            done += run;
+            UTF8_COUNT(ascii_bytes, run);
+            continue;
+        }
+        run = utf8_decode_3_ssse3(x, &value);
+        if (run == 0) run = utf8_decode_4_ssse3(x, &value);
+        if (run != 0) {
+            _mm_storeu_si128((__m128i *)(dst + done), value);
+            i += run;
+            done += 4;
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = i;
+        state = utf8_step(UTF8_ACCEPT, &rune, (unsigned char)s[i++]);
+        while (state > UTF8_REJECT)
+            state = utf8_step(state, &rune, (unsigned char)s[i++]);
+        if (state != UTF8_ACCEPT) {
+            i = start;
+            break;
+        }
+        dst[done++] = rune;
+    }
+    *used = i;
+    return done;
+}
+
+#endif
+
+size_t utf8_decode_runes(int32_t *dst, const char *src, size_t len, 
+    size_t *consumed)
+{
+    uint32_t state;
+    int32_t value = 0;
+    size_t done = 0, used = 0, start;
+    if (src == NULL) {
+        errno = EINVAL;
+        if (consumed != NULL) *consumed = 0;
+        return 0;
+    }
+    if (dst == NULL) {
+        used = utf8_valid_prefix(src, len);
+        if (consumed != NULL) *consumed = used;
+        if (used < len) {
+            UTF8_EILSEQ();
+            return (size_t)-1;
+        }
+        return utf8_count_runes(src, len);
+    }
+#if defined(UTF8_X86)
+    if (len >= 16 && (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        done = utf8_decode_runes_ssse3(dst, src, len, len, &used);
+#endif
+    while (used < len) {
+        if ((0x80 & src[used]) == 0) {
+            dst[done++] = src[used++];
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = used;
+        state = utf8_step(UTF8_ACCEPT, &value, (unsigned char)src[used++]);
+        while (state > UTF8_REJECT && used < len)
+            state = utf8_step(state, &value, (unsigned char)src[used++]);
+        if (state != UTF8_ACCEPT) { /* invalid or incomplete */
+            used = start;
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        dst[done++] = value;
+    }
+    if (consumed != NULL) *consumed = used;
+    return done;
+}
+
+#if defined(UTF8_X86)
+
+/*
+Converts to UTF-8 at `dst` the Latin-1 characters at `s` while 16 are left
+and there's room for 32 bytes in the `room` bytes at `dst`. The blocks 
+holding characters above 0x7f are encoded in `part`, only their bytes being
+copied to `dst`. Stores in `used` the number of characters converted and 
+returns the number of bytes written.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_of_latin1_ssse3(char *dst, const char *s, size_t n, 
+    size_t room, size_t *used)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+    size_t i = 0, n_bytes = 0, size;
+    char part[32];
+    while (n - i >= 16 && room - n_bytes >= 32) {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(x) == 0) {
+            _mm_storeu_si128((__m128i *)(dst + n_bytes), x);
+            n_bytes += 16;
+            UTF8_COUNT(ascii_bytes, 16);
+        } else {
+            /* every character is a rune below U+0100 */
+            size = utf8_encode_2_ssse3(part, _mm_unpacklo_epi8(x, zero));
+            size += utf8_encode_2_ssse3(part + size, 
+                _mm_unpackhi_epi8(x, zero));
+            memcpy(dst + n_bytes, part, size);
+            n_bytes += size;
+        }
+        i += 16;
+    }
+    *used = i;
+    return n_bytes;
+}
+
+/*
+Converts to Latin-1 at `dst` the UTF-8 bytes at `s` while 16 are left and 
+there's room for 16 characters in the `room` characters at `dst`, writing
+`replacement` (below 0x100) for the runes above U+00FF, stopping before an
+invalid sequence or, if `replacement` is negative, a rune above U+00FF. 
+Nothing is written past the characters converted. Stores in `used` the 
+number of bytes converted and returns the number of characters written.
+*/
+__attribute__((target("ssse3")))
+static size_t utf8_to_latin1_ssse3(char *dst, const char *s, size_t n_bytes,
+    size_t room, size_t *used, int replacement)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x, value, m;
+    uint32_t state;
+    int32_t rune = 0;
+    size_t i = 0, done = 0, start, run, n_runes;
+    unsigned high;
+    char part[16], *out;
+    while (n_bytes - i >= 16 && room - done >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        high = (unsigned)_mm_movemask_epi8(x);
+        run = (high & 0xff) != 0 ? utf8_decode_2_ssse3(x, &value, &n_runes)
+            : 0;
+        if (run != 0) {
+            m = _mm_cmpgt_epi16(value, _mm_set1_epi16(0xff));
+            if (_mm_movemask_epi8(m) != 0) {
+                if (replacement < 0) break;
+                value = _mm_or_si128(_mm_andnot_si128(m, value), 
+                    _mm_and_si128(m, _mm_set1_epi16((short)replacement)));
+            }
+            out = n_runes == 8 ? dst + done : part;
+            _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(value, zero));
+            if (out == part) memcpy(dst + done, part, n_runes);
+            i += run;
+            done += n_runes;
+            continue;
+        }
+        if ((high & 1) == 0) {
+            /* copy the ASCII bytes */
+            run = high == 0 ? 16 : (size_t)__builtin_ctz(high);
+            if (run == 16) _mm_storeu_si128((__m128i *)(dst + done), x);
+            else memcpy(dst + done, s + i, run);
+            i += run;
+            done += run;
+            UTF8_COUNT(ascii_bytes, run);
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = i;
+        state = utf8_step(UTF8_ACCEPT, &rune, (unsigned char)s[i++]);
+        while (state > UTF8_REJECT)
+            state = utf8_step(state, &rune, (unsigned char)s[i++]);
+        if (state != UTF8_ACCEPT || (rune > 0xff && replacement < 0)) {
+            i = start;
+            break;
+        }
+        dst[done++] = (char)(rune > 0xff ? replacement : rune);
+    }
+    *used = i;
+    return done;
+}
+
+#endif
+
+size_t utf8_of_latin1(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    size_t done = 0, used = 0;
+    unsigned char c;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) {
+        /* two bytes for the characters above 0x7f */
+        if (parsed != NULL) *parsed = n_bytes;
+        return n_bytes + utf8_count_bytes(s, n_bytes, 0x80, -1);
+    }
+#if defined(UTF8_X86)
+    if (n_bytes >= 16 && count >= 32 && (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        done = utf8_of_latin1_ssse3(buffer, s, n_bytes, count, &used);
+#endif
+    while (used < n_bytes && done < count) {
+        c = (unsigned char)s[used];
+        if (c < 0x80) {
+            buffer[done++] = (char)c;
+        } else {
+            if (count - done < 2) break;
+            buffer[done++] = (char)(0xc0 | (c >> 6));
+            buffer[done++] = (char)(0x80 | (0x3f & c));
+        }
+        used += 1;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_to_latin1(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed, int replacement)
+{
+    int32_t rune;
+    size_t done = 0, used = 0, rune_size;
+    if (s == NULL || replacement > 0xff) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL && utf8_valid_prefix(s, n_bytes) == n_bytes && 
+        (replacement >= 0 || utf8_count_bytes(s, n_bytes, 0x80, 0x43) == 0)) {
+        /* one character per rune, no lead byte above 0xc3 to fail on */
+        if (parsed != NULL) *parsed = n_bytes;
+        return utf8_count_runes(s, n_bytes);
+    }
+    if (buffer == NULL) count = (size_t)-1;
+#if defined(UTF8_X86)
+    if (buffer != NULL && n_bytes >= 16 && count >= 16 && 
+        (utf8_cpu() & UTF8_CPU_SSSE3) != 0)
+        done = utf8_to_latin1_ssse3(buffer, s, n_bytes, count, &used, 
+            replacement);
+#endif
+    while (used < n_bytes && done < count) {
+        if ((0x80 & s[used]) == 0) {
+            if (buffer != NULL) buffer[done] = s[used];
+            used += 1;
+            done += 1;
+            continue;
+        }
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0 || (rune > 0xff && replacement < 0)) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (buffer != NULL) 
+            buffer[done] = (char)(rune > 0xff ? replacement : rune);
+        used += rune_size;
+        done += 1;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+#if defined(_WIN32)
+
+/* The wide characters are UTF-16 units, converted by the UTF-16 functions. */
+
+size_t utf8_bytes_needed_for_wchars(const wchar_t *p, size_t n_wchars)
+{
+    size_t n_bytes;
+    if (p == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_bytes = utf8_utf16_size((const uint16_t *)p, n_wchars);
+    if (n_bytes == (size_t)-1) UTF8_EILSEQ();
+    return n_bytes;
+}
+
+size_t utf8_to_wchars_n(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    return utf8_to_utf16((uint16_t *)buffer, s, n_bytes, count, parsed);
+}
+
+size_t utf8_to_wchars_lossy(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed, size_t *first_error)
+{
+    int32_t rune;
+    size_t done = 0, used = 0, error = n_bytes, rune_size, wc_size;
+    uint16_t cache[2];
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        if (first_error != NULL) *first_error = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    while (used < n_bytes && done < count) {
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0) { /* replace the maximal subpart */
+            rune_size = utf8_invalid_size(s + used, n_bytes - used);
+            rune = 0xfffd;
+            if (error == n_bytes) error = used;
+        }
+        wc_size = utf16_encode(cache, rune); /* encode to the cache */
+        if (wc_size > count - done) break;
+        if (buffer != NULL) { /* copy the cache */
+            *buffer++ = cache[0];
+            if (wc_size > 1) *buffer++ = cache[1];
+        }
+        used += rune_size;
+        done += wc_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    if (first_error != NULL) *first_error = error;
+    return done;
+}
+
+size_t utf8_of_wchars_n(char *buffer, const wchar_t *p, size_t n_wchars,
+    size_t count, size_t *parsed)
+{
+    return utf8_of_utf16(buffer, (const uint16_t *)p, n_wchars, count, 
+        parsed);
+}
+
+size_t utf8_to_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    int32_t rune;
+    /*
+    I use an array of three wide chars of which the last is always 0. This 
+    allows using the wcstombs function knowing that its source will always 
+    end in a 0 rune.
+    */
+    wchar_t ws_buffer[] = {0, 0, 0};
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    char cache[MB_LEN_MAX * 2];
+    size_t done = 0, used = 0, rune_size, mb_size;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    while (used < n_bytes && done < count) {
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        ws_buffer[1] = 0; /* clear the (maybe left off) second wide character */
+        /* only the valid runes get here */
+        utf16_encode((uint16_t *)ws_buffer, rune);
+        if (rune == 0) {
+            cache[0] = 0; /* wcstombs stops before the 0 */
+            mb_size = 1;
+        } else {
+            UTF8_COUNT(libc_calls, 1);
+            mb_size = wcstombs(cache, ws_buffer, sizeof(cache));
+        }
+        if (mb_size == (size_t)-1) { /* can't encode */
+            UTF8_COUNT(errors, 1);
+            done = (size_t)-1;
+            break;
+        }
+        if (mb_size > count - done) break;
+        if (buffer != NULL) {
+            memcpy(buffer, cache, mb_size);
+            buffer += mb_size;
+        }
+        used += rune_size;
+        done += mb_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_of_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    int32_t rune;
+    wchar_t ws_buffer[] = {0, 0};
+    mbstate_t state;
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    char cache[4];
+    size_t done = 0, used = 0, mb_size, mb_next, rune_size;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    memset(&state, 0, sizeof(state));
+    while (used < n_bytes && done < count) {
+        UTF8_COUNT(libc_calls, 1);
+        mb_size = mbrtowc(ws_buffer, s + used, n_bytes - used, &state);
+        if (mb_size == 0) mb_size = 1; /* the 0 character */
+        if ((0xfc00 & ws_buffer[0]) == 0xd800 && mb_size < (size_t)-2) {
+            /* surrogate pair */
+            UTF8_COUNT(libc_calls, 1);
+            mb_next = mbrtowc(ws_buffer + 1, s + used + mb_size, 
+                n_bytes - used - mb_size, &state);
+            if (mb_next >= (size_t)-2) mb_size = mb_next;
+            else mb_size += mb_next;
+        }
+        if (mb_size >= (size_t)-2) { /* invalid or incomplete */
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (utf16_decode(&rune, (const uint16_t *)ws_buffer, 2) == 0 || 
+            (rune_size = utf8_encode(cache, rune)) == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (rune_size > count - done) break;
+        if (buffer != NULL) {
+            *buffer++ = cache[0];
+            if (rune_size > 1) *buffer++ = cache[1];
+            if (rune_size > 2) *buffer++ = cache[2];
+            if (rune_size > 3) *buffer++ = cache[3];
+        }
+        used += mb_size;
+        done += rune_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+#else
+
+#if defined(UTF8_X86)
+
+__attribute__((target("sse2")))
+static size_t utf8_widen_ascii_sse2(wchar_t *buffer, const char *s, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i input, half;
+    size_t done = 0;
+    while (n - done >= 16) {
+        input = _mm_loadu_si128((const __m128i *)(s + done));
+        if (_mm_movemask_epi8(input) != 0) break;
+        if (buffer != NULL) {
+            half = _mm_unpacklo_epi8(input, zero);
+            _mm_storeu_si128((__m128i *)(buffer + done), 
+                _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(buffer + done + 4), 
+                _mm_unpackhi_epi16(half, zero));
+            half = _mm_unpackhi_epi8(input, zero);
+            _mm_storeu_si128((__m128i *)(buffer + done + 8), 
+                _mm_unpacklo_epi16(half, zero));
+            _mm_storeu_si128((__m128i *)(buffer + done + 12), 
+                _mm_unpackhi_epi16(half, zero));
+        }
+        done += 16;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_widen_ascii_avx2(wchar_t *buffer, const char *s, size_t n)
+{
+    __m256i input;
+    size_t done = 0;
+    while (n - done >= 32) {
+        input = _mm256_loadu_si256((const __m256i *)(s + done));
+        if (_mm256_movemask_epi8(input) != 0) break;
+        if (buffer != NULL) {
+            _mm256_storeu_si256((__m256i *)(buffer + done), 
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                (const __m128i *)(s + done))));
+            _mm256_storeu_si256((__m256i *)(buffer + done + 8), 
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                (const __m128i *)(s + done + 8))));
+            _mm256_storeu_si256((__m256i *)(buffer + done + 16), 
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                (const __m128i *)(s + done + 16))));
+            _mm256_storeu_si256((__m256i *)(buffer + done + 24), 
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                (const __m128i *)(s + done + 24))));
+        }
+        done += 32;
+    }
+    return done + utf8_widen_ascii_sse2(buffer == NULL ? NULL : 
+        buffer + done, s + done, n - done);
+}
+
+__attribute__((target("sse2")))
+static size_t utf8_narrow_ascii_sse2(char *buffer, const wchar_t *p, size_t n)
+{
+    const __m128i high = _mm_set1_epi32(~0x7f);
+    __m128i w0, w1, w2, w3;
+    size_t done = 0;
+    while (n - done >= 16) {
+        w0 = _mm_loadu_si128((const __m128i *)(p + done));
+        w1 = _mm_loadu_si128((const __m128i *)(p + done + 4));
+        w2 = _mm_loadu_si128((const __m128i *)(p + done + 8));
+        w3 = _mm_loadu_si128((const __m128i *)(p + done + 12));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(high, 
+            _mm_or_si128(_mm_or_si128(w0, w1), _mm_or_si128(w2, w3))),
+            _mm_setzero_si128())) != 0xffff) break;
+        if (buffer != NULL)
+            _mm_storeu_si128((__m128i *)(buffer + done), _mm_packus_epi16(
+                _mm_packs_epi32(w0, w1), _mm_packs_epi32(w2, w3)));
+        done += 16;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_narrow_ascii_avx2(char *buffer, const wchar_t *p, size_t n)
+{
+    const __m256i high = _mm256_set1_epi32(~0x7f);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i w0, w1, w2, w3;
+    size_t done = 0;
+    while (n - done >= 32) {
+        w0 = _mm256_loadu_si256((const __m256i *)(p + done));
+        w1 = _mm256_loadu_si256((const __m256i *)(p + done + 8));
+        w2 = _mm256_loadu_si256((const __m256i *)(p + done + 16));
+        w3 = _mm256_loadu_si256((const __m256i *)(p + done + 24));
+        if (!_mm256_testz_si256(high, _mm256_or_si256(
+            _mm256_or_si256(w0, w1), _mm256_or_si256(w2, w3)))) break;
+        if (buffer != NULL)
+            _mm256_storeu_si256((__m256i *)(buffer + done), 
+                _mm256_permutevar8x32_epi32(_mm256_packus_epi16(
+                _mm256_packs_epi32(w0, w1), _mm256_packs_epi32(w2, w3)), 
+                order));
+        done += 32;
+    }
+    return done + utf8_narrow_ascii_sse2(buffer == NULL ? NULL : 
+        buffer + done, p + done, n - done);
+}
+
+#endif
+
+/*
+Copies to `buffer` (when not NULL) as wide characters the ASCII characters
+found at the start of the `n` characters at `s`, a block at a time.
+Returns the number of characters copied.
+*/
+static size_t utf8_widen_ascii(wchar_t *buffer, const char *s, size_t n)
+{
+    size_t i, done = 0;
+    uint64_t word;
+#if defined(UTF8_X86) && WCHAR_MAX > 0xffff
+    if (n >= 32 && (utf8_cpu() & UTF8_CPU_AVX2))
+        done = utf8_widen_ascii_avx2(buffer, s, n);
+    else if (n >= 16 && (utf8_cpu() & UTF8_CPU_SSE2))
+        done = utf8_widen_ascii_sse2(buffer, s, n);
+#endif
+    while (n - done >= 8) {
+        memcpy(&word, s + done, 8);
+        if ((word & UINT64_C(0x8080808080808080)) != 0) break;
+        if (buffer != NULL) {
+            for (i = 0; i < 8; i++) buffer[done + i] = (wchar_t)s[done + i];
+        }
+        done += 8;
+    }
+    while (done < n && (0x80 & s[done]) == 0) {
+        if (buffer != NULL) buffer[done] = (wchar_t)s[done];
+        done += 1;
+    }
+    UTF8_COUNT(ascii_bytes, done);
+    return done;
+}
+
+/*
+Copies to `buffer` (when not NULL) as characters the wide characters below
+0x80 found at the start of the `n` wide characters at `p`, a block at a 
+time.
+Returns the number of wide characters copied.
+*/
+static size_t utf8_narrow_ascii(char *buffer, const wchar_t *p, size_t n)
+{
+    size_t done = 0;
+#if defined(UTF8_X86) && WCHAR_MAX > 0xffff
+    if (n >= 32 && (utf8_cpu() & UTF8_CPU_AVX2))
+        done = utf8_narrow_ascii_avx2(buffer, p, n);
+    else if (n >= 16 && (utf8_cpu() & UTF8_CPU_SSE2))
+        done = utf8_narrow_ascii_sse2(buffer, p, n);
+#endif
+    while (done < n && ((int32_t)p[done] & ~0x7f) == 0) {
+        if (buffer != NULL) buffer[done] = (char)p[done];
+        done += 1;
+    }
+    UTF8_COUNT(ascii_bytes, done);
+    return done;
+}
+
+size_t utf8_bytes_needed_for_wchars(const wchar_t *p, size_t n_wchars)
+{
+    size_t i = 0, n_bytes = 0, rune_size;
+    if (p == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+#if WCHAR_MAX > 0xffff
+    n_bytes = utf8_units_size(p, n_wchars, &i);
+    if (n_bytes == (size_t)-1) {
+        UTF8_EILSEQ();
+        return (size_t)-1;
+    }
+#endif
+    for (; i < n_wchars; i++) {
+        rune_size = utf8_encode(NULL, (int32_t)p[i]);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            return (size_t)-1;
+        }
+        n_bytes += rune_size;
+    }
+    return n_bytes;
+}
+
+size_t utf8_to_wchars_n(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    uint32_t state;
+    int32_t value = 0;
+    size_t done = 0, used = 0, start, run;
+    uint64_t word;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL && utf8_valid_prefix(s, n_bytes) == n_bytes) {
+        /* size the valid input by counting instead of decoding it */
+        if (parsed != NULL) *parsed = n_bytes;
+        return utf8_wchars_needed(s, n_bytes);
+    }
+    if (buffer == NULL) count = (size_t)-1;
+#if defined(UTF8_X86) && WCHAR_MAX > 0xffff
+    /* the wide characters are runes */
+    if (buffer != NULL && n_bytes >= 16 && count >= 16 && 
+        (utf8_cpu() & UTF8_CPU_SSSE3) != 0) {
+        done = utf8_decode_runes_ssse3((int32_t *)buffer, s, n_bytes, count,
+            &used);
+        buffer += done;
+    }
+#endif
+    while (used < n_bytes && done < count) {
+        if ((0x80 & s[used]) == 0) {
+            run = 1;
+            if (n_bytes - used >= 16) {
+                memcpy(&word, s + used, 8);
+                if ((word & UINT64_C(0x8080808080808080)) == 0)
+                    run = utf8_widen_ascii(buffer, s + used, 
+                        n_bytes - used < count - done ? 
+                        n_bytes - used : count - done);
+            }
+            if (run == 1 && buffer != NULL) *buffer = (wchar_t)s[used];
+            if (buffer != NULL) buffer += run;
+            used += run;
+            done += run;
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = used;
+        state = utf8_step(UTF8_ACCEPT, &value, (unsigned char)s[used++]);
+        while (state > UTF8_REJECT && used < n_bytes)
+            state = utf8_step(state, &value, (unsigned char)s[used++]);
+        if (state != UTF8_ACCEPT) { /* invalid or incomplete */
+            used = start;
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (buffer != NULL) *buffer++ = (wchar_t)value;
+        done += 1;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_to_wchars_lossy(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed, size_t *first_error)
+{
+    uint32_t state;
+    int32_t value = 0;
+    size_t done = 0, used = 0, error = n_bytes, start, run;
+    uint64_t word;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        if (first_error != NULL) *first_error = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    while (used < n_bytes && done < count) {
+        if ((0x80 & s[used]) == 0) {
+            run = 1;
+            if (n_bytes - used >= 16) {
+                memcpy(&word, s + used, 8);
+                if ((word & UINT64_C(0x8080808080808080)) == 0)
+                    run = utf8_widen_ascii(buffer, s + used, 
+                        n_bytes - used < count - done ? 
+                        n_bytes - used : count - done);
+            }
+            if (run == 1 && buffer != NULL) *buffer = (wchar_t)s[used];
+            if (buffer != NULL) buffer += run;
+            used += run;
+            done += run;
+            continue;
+        }
+        /* feed the automaton until the sequence ends */
+        start = used;
+        state = utf8_step(UTF8_ACCEPT, &value, (unsigned char)s[used++]);
+        while (state > UTF8_REJECT && used < n_bytes)
+            state = utf8_step(state, &value, (unsigned char)s[used++]);
+        if (state != UTF8_ACCEPT) { /* replace the maximal subpart */
+            /* the byte breaking a sequence may start the next one */
+            if (state == UTF8_REJECT && used - start > 1) used--;
+            if (error == n_bytes) error = start;
+            value = 0xfffd;
+        }
+        if (buffer != NULL) *buffer++ = (wchar_t)value;
+        done += 1;
+    }
+    if (parsed != NULL) *parsed = used;
+    if (first_error != NULL) *first_error = error;
+    return done;
+}
+
+size_t utf8_of_wchars_n(char *buffer, const wchar_t *p, size_t n_wchars,
+    size_t count, size_t *parsed)
+{
+    size_t done = 0, used = 0, rune_size;
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    char cache[4];
+    if (p == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) {
+        done = utf8_bytes_needed_for_wchars(p, n_wchars);
+        if (done != (size_t)-1) {
+            if (parsed != NULL) *parsed = n_wchars;
+            return done;
+        }
+        done = 0; /* convert up to the invalid character */
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    while (used < n_wchars && done < count) {
+        if (((int32_t)p[used] & ~0x7f) == 0) {
+            rune_size = utf8_narrow_ascii(buffer, p + used, 
+                n_wchars - used < count - done ? n_wchars - used : count - done);
+            if (buffer != NULL) buffer += rune_size;
+            used += rune_size;
+            done += rune_size;
+            continue;
+        }
+        rune_size = utf8_encode(cache, (int32_t)p[used]);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (rune_size > count - done) break;
+        if (buffer != NULL) {
+            *buffer++ = cache[0];
+            if (rune_size > 1) *buffer++ = cache[1];
+            if (rune_size > 2) *buffer++ = cache[2];
+            if (rune_size > 3) *buffer++ = cache[3];
+        }
+        used += 1;
+        done += rune_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_to_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    int32_t rune;
+    mbstate_t state;
+    size_t done = 0, used = 0, rune_size, mb_size;
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    char cache[MB_LEN_MAX];
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    memset(&state, 0, sizeof(state));
+    while (used < n_bytes && done < count) {
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        UTF8_COUNT(libc_calls, 1);
+        mb_size = wcrtomb(cache, (wchar_t)rune, &state);
+        if (mb_size == (size_t)-1) { /* can't encode */
+            UTF8_COUNT(errors, 1);
+            done = (size_t)-1;
+            break;
+        }
+        if (mb_size > count - done) break;
+        if (buffer != NULL) {
+            memcpy(buffer, cache, mb_size);
+            buffer += mb_size;
+        }
+        used += rune_size;
+        done += mb_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+size_t utf8_of_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    wchar_t wc;
+    mbstate_t state;
+    size_t done = 0, used = 0, mb_size, rune_size;
+    /* don't write directly to `buffer`, encode in `cache` buffer first, */
+    /* then check if the result fits within `count` output units         */
+    char cache[4];
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    memset(&state, 0, sizeof(state));
+    while (used < n_bytes && done < count) {
+        UTF8_COUNT(libc_calls, 1);
+        mb_size = mbrtowc(&wc, s + used, n_bytes - used, &state);
+        if (mb_size >= (size_t)-2) { /* invalid or incomplete */
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (mb_size == 0) mb_size = 1; /* the 0 character */
+        rune_size = utf8_encode(cache, (int32_t)wc);
+        if (rune_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (rune_size > count - done) break;
+        if (buffer != NULL) {
+            *buffer++ = cache[0];
+            if (rune_size > 1) *buffer++ = cache[1];
+            if (rune_size > 2) *buffer++ = cache[2];
+            if (rune_size > 3) *buffer++ = cache[3];
+        }
+        used += mb_size;
+        done += rune_size;
+    }
+    if (parsed != NULL) *parsed = used;
+    return done;
+}
+
+#endif
+
+size_t utf8_repair(char *buffer, const char *s, size_t n_bytes, size_t count,
+    size_t *parsed, size_t *first_error)
+{
+    size_t done = 0, used = 0, error = n_bytes, run, size;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        if (first_error != NULL) *first_error = 0;
+        return 0;
+    }
+    if (buffer == NULL) count = (size_t)-1;
+    while (used < n_bytes) {
+        /* copy the valid run, cut before a sequence if it doesn't fit */
+        run = utf8_valid_prefix(s + used, n_bytes - used);
+        size = run;
+        if (run > count - done) {
+            run = count - done;
+            while (run > 0 && (0xc0 & s[used + run]) == 0x80) run--;
+        }
+        if (buffer != NULL) memcpy(buffer + done, s + used, run);
+        used += run;
+        done += run;
+        if (run < size || used == n_bytes) break;
+        /* replace the maximal subpart with U+FFFD */
+        if (error == n_bytes) error = used;
+        if (count - done < 3) break;
+        if (buffer != NULL) memcpy(buffer + done, "\xef\xbf\xbd", 3);
+        used += utf8_invalid_size(s + used, n_bytes - used);
+        done += 3;
+    }
+    if (parsed != NULL) *parsed = used;
+    if (first_error != NULL) *first_error = error;
+    return done;
+}
+
+static void *utf8_default_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *utf8_default_resize(void *ctx, void *p, size_t old_size, 
+    size_t size)
+{
+    (void)ctx;
+    (void)old_size;
+    return realloc(p, size);
+}
+
+static void utf8_default_release(void *ctx, void *p, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(p);
+}
+
+static const utf8_allocator utf8_default_allocator = {
+    utf8_default_alloc, utf8_default_resize, utf8_default_release, NULL
+};
+
+wchar_t *utf8_to_wchars_alloc(const utf8_allocator *allocator, 
+    const char *s, size_t n_bytes, size_t *n_wchars)
+{
+    wchar_t *buffer, *shrunk;
+    size_t done;
+    if (allocator == NULL) allocator = &utf8_default_allocator;
+    if (s == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* a byte gives at most one wide character, even with UTF-16 */
+    buffer = NULL;
+    if (n_bytes < (size_t)-1 / sizeof(wchar_t))
+        buffer = allocator->alloc(allocator->ctx, 
+            (n_bytes + 1) * sizeof(wchar_t));
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    done = utf8_to_wchars_n(buffer, s, n_bytes, n_bytes, NULL);
+    if (done == (size_t)-1) {
+        allocator->release(allocator->ctx, buffer, 
+            (n_bytes + 1) * sizeof(wchar_t));
+        errno = EILSEQ; /* counted by the conversion */
+        return NULL;
+    }
+    buffer[done] = 0;
+    shrunk = allocator->resize(allocator->ctx, buffer, 
+        (n_bytes + 1) * sizeof(wchar_t), (done + 1) * sizeof(wchar_t));
+    if (shrunk != NULL) buffer = shrunk;
+    if (n_wchars != NULL) *n_wchars = done;
+    return buffer;
+}
+
+char *utf8_of_wchars_alloc(const utf8_allocator *allocator, 
+    const wchar_t *p, size_t n_wchars, size_t *n_bytes)
+{
+    char *buffer, *shrunk;
+    size_t done, count;
+    if (allocator == NULL) allocator = &utf8_default_allocator;
+    if (p == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* a wide character gives at most 4 bytes */
+    count = n_wchars * 4;
+    buffer = NULL;
+    if (n_wchars < (size_t)-1 / 4)
+        buffer = allocator->alloc(allocator->ctx, count + 1);
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    done = utf8_of_wchars_n(buffer, p, n_wchars, count, NULL);
+    if (done == (size_t)-1) {
+        allocator->release(allocator->ctx, buffer, count + 1);
+        errno = EILSEQ; /* counted by the conversion */
+        return NULL;
+    }
+    buffer[done] = 0;
+    shrunk = allocator->resize(allocator->ctx, buffer, count + 1, done + 1);
+    if (shrunk != NULL) buffer = shrunk;
+    if (n_bytes != NULL) *n_bytes = done;
+    return buffer;
+}
+
+/* the alignment of the allocations made in an arena */
+#define UTF8_ARENA_ALIGN 16
+
+struct utf8_arena_block {
+    struct utf8_arena_block *next;
+    size_t size; /* the number of bytes at `data` */
+    size_t used;
+    size_t last; /* the offset of the last allocation */
+    unsigned char *data;
+};
+
+struct utf8_arena {
+    size_t block_size;
+    struct utf8_arena_block *first;
+    struct utf8_arena_block *current; /* the blocks after it are empty */
+};
+
+utf8_arena *utf8_arena_open(size_t block_size)
+{
+    utf8_arena *arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena->block_size = block_size > 0 ? block_size : 65536;
+    return arena;
+}
+
+void utf8_arena_reset(utf8_arena *arena)
+{
+    struct utf8_arena_block *block;
+    for (block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+        block->last = 0;
+    }
+    arena->current = arena->first;
+}
+
+void utf8_arena_close(utf8_arena *arena)
+{
+    struct utf8_arena_block *block, *next;
+    if (arena == NULL) return;
+    for (block = arena->first; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+/*
+Returns the block of `arena` receiving an allocation of `size` bytes: the 
+current one, the next one if it's large enough, or a new one inserted 
+after the current one. Returns NULL if there's not enough memory.
+*/
+static struct utf8_arena_block *utf8_arena_block_for(utf8_arena *arena, 
+    size_t size)
+{
+    struct utf8_arena_block *block = arena->current, *fresh;
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    if (block != NULL && block->size - block->used >= size) return block;
+    if (block != NULL && block->next != NULL && block->next->size >= size) {
+        arena->current = block->next;
+        return block->next;
+    }
+    if (block_size > (size_t)-1 - sizeof(*fresh) - UTF8_ARENA_ALIGN) 
+        return NULL;
+    fresh = malloc(sizeof(*fresh) + UTF8_ARENA_ALIGN + block_size);
+    if (fresh == NULL) return NULL;
+    fresh->data = (unsigned char *)(fresh + 1);
+    fresh->data += (UTF8_ARENA_ALIGN - 
+        (uintptr_t)fresh->data % UTF8_ARENA_ALIGN) % UTF8_ARENA_ALIGN;
+    fresh->size = block_size;
+    fresh->used = 0;
+    fresh->last = 0;
+    if (block == NULL) {
+        fresh->next = arena->first;
+        arena->first = fresh;
+    } else {
+        fresh->next = block->next;
+        block->next = fresh;
+    }
+    arena->current = fresh;
+    return fresh;
+}
+
+static void *utf8_arena_alloc(void *ctx, size_t size)
+{
+    utf8_arena *arena = ctx;
+    struct utf8_arena_block *block;
+    if (size > (size_t)-1 - UTF8_ARENA_ALIGN) return NULL;
+    size = (size + UTF8_ARENA_ALIGN - 1) & ~(size_t)(UTF8_ARENA_ALIGN - 1);
+    block = utf8_arena_block_for(arena, size);
+    if (block == NULL) return NULL;
+    block->last = block->used;
+    block->used += size;
+    return block->data + block->last;
+}
+
+/* Returns 1 if `p` is the last allocation made in `arena`. */
+static int utf8_arena_is_last(const utf8_arena *arena, const void *p)
+{
+    const struct utf8_arena_block *block = arena->current;
+    return p != NULL && block != NULL && block->used > block->last && 
+        (const unsigned char *)p == block->data + block->last;
+}
+
+static void *utf8_arena_resize(void *ctx, void *p, size_t old_size, 
+    size_t size)
+{
+    utf8_arena *arena = ctx;
+    struct utf8_arena_block *block = arena->current;
+    size_t aligned = (size + UTF8_ARENA_ALIGN - 1) & 
+        ~(size_t)(UTF8_ARENA_ALIGN - 1);
+    void *q;
+    if (utf8_arena_is_last(arena, p) && size <= aligned && 
+        aligned <= block->size - block->last) {
+        block->used = block->last + aligned; /* grow or shrink in place */
+        return p;
     }
-    return done;
+    q = utf8_arena_alloc(ctx, size);
+    if (q != NULL && p != NULL) memcpy(q, p, old_size < size ? old_size : size);
+    return q;
 }
 
-size_t utf8_to_local(char *buffer, const char *s, size_t count)
+static void utf8_arena_release(void *ctx, void *p, size_t size)
+{
+    utf8_arena *arena = ctx;
+    (void)size;
+    /* only the last allocation gives its memory back before a reset */
+    if (utf8_arena_is_last(arena, p)) 
+        arena->current->used = arena->current->last;
+}
+
+utf8_allocator utf8_arena_allocator(utf8_arena *arena)
+{
+    utf8_allocator allocator;
+    allocator.alloc = utf8_arena_alloc;
+    allocator.resize = utf8_arena_resize;
+    allocator.release = utf8_arena_release;
+    allocator.ctx = arena;
+    return allocator;
+}
+
+/*
+The converter of a single-byte locale maps the bytes to runes with a table
+and the runes back to bytes with an open addressing hash table holding the
+(at most 256) runes of the locale. The converter of a multibyte locale 
+keeps the locale and converts with the locale's own functions.
+*/
+
+/* the number of slots of the hash table, twice the number of bytes */
+#define UTF8_LOCAL_SLOTS 512
+
+struct utf8_local_conv {
+#if defined(_WIN32)
+    _locale_t locale;
+#else
+    locale_t locale;
+#endif
+    int single; /* single-byte locale, converted using the tables */
+    int ascii; /* the bytes 0...127 are the ASCII characters */
+    int32_t runes[256]; /* the rune of each byte, -1 if invalid */
+    int32_t keys[UTF8_LOCAL_SLOTS]; /* the runes in the hash, -1 if empty */
+    unsigned char bytes[UTF8_LOCAL_SLOTS]; /* the byte of each rune */
+};
+
+static size_t utf8_local_slot(int32_t rune)
+{
+    return ((uint32_t)rune * 2654435761u >> 16) & (UTF8_LOCAL_SLOTS - 1);
+}
+
+/* Returns the byte encoding `rune` in a single-byte locale, or -1. */
+static int utf8_local_byte(const utf8_local_conv *conv, int32_t rune)
+{
+    size_t i = utf8_local_slot(rune);
+    while (conv->keys[i] != -1) {
+        if (conv->keys[i] == rune) return conv->bytes[i];
+        i = (i + 1) & (UTF8_LOCAL_SLOTS - 1);
+    }
+    return -1;
+}
+
+#if defined(_WIN32)
+
+/*
+Opens the locale of `conv` and stores in `runes` the wide character of each 
+byte (or -1). Returns 0, or -1 if the locale doesn't exist.
+*/
+static int utf8_local_conv_init(utf8_local_conv *conv, const char *name)
+{
+    wchar_t wc;
+    char c;
+    int i;
+    if (name == NULL) conv->locale = _get_current_locale();
+    else conv->locale = _create_locale(LC_CTYPE, name);
+    if (conv->locale == NULL) return -1;
+    conv->single = ___mb_cur_max_l_func(conv->locale) == 1;
+    for (i = 0; i < 256; i++) {
+        c = (char)i;
+        wc = 0;
+        conv->runes[i] = _mbtowc_l(&wc, &c, 1, conv->locale) >= 0 ? wc : -1;
+    }
+    return 0;
+}
+
+void utf8_local_conv_close(utf8_local_conv *conv)
+{
+    if (conv == NULL) return;
+    _free_locale(conv->locale);
+    free(conv);
+}
+
+size_t utf8_to_local_l(_locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed)
 {
     int32_t rune;
-    /*
-    I use an array of three wide chars of which the last is always 0. This 
-    allows using the wcstombs function knowing that its source will always 
-    end in a 0 rune.
-    */
-    wchar_t ws_buffer[] = {0, 0, 0};
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
-    char cache[4];
-    size_t done = 0, parsed, mb_size;
-    if (s == NULL) {
+    int mb_size;
+    char cache[MB_LEN_MAX];
+    size_t done = 0, used = 0, rune_size;
+    if (locale == NULL || s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = utf8_decode(&rune, s, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
+    while (used < n_bytes && done < count) {
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        UTF8_COUNT(libc_calls, rune_size != 0 && rune <= 0xffff);
+        /* the locale functions take a single 16-bit wide character */
+        if (rune_size == 0 || rune > 0xffff || 
+            (mb_size = _wctomb_l(cache, (wchar_t)rune, locale)) < 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
         }
-        ws_buffer[1] = 0; /* clear the (maybe left off) second wide character */
-        utf16_encode(ws_buffer, rune); /* only the valid runes get here */
-        mb_size = wcstombs(cache, ws_buffer, (size_t)-1);
-        if (mb_size == (size_t)-1) return (size_t)-1; /* can't encode */
-        if (mb_size > count - done) break;
+        if ((size_t)mb_size > count - done) break;
         if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (mb_size > 1) *buffer++ = cache[1];
-            if (mb_size > 2) *buffer++ = cache[2];
-            if (mb_size > 3) *buffer++ = cache[3];
+            memcpy(buffer, cache, mb_size);
+            buffer += mb_size;
         }
-        if (rune == 0) break;
-        s += parsed;
+        used += rune_size;
         done += mb_size;
     }
+    if (parsed != NULL) *parsed = used;
     return done;
 }
 
-size_t utf8_of_local(char *buffer, const char *s, size_t count)
+size_t utf8_of_local_l(_locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed)
 {
-    int32_t rune;
-    wchar_t ws_buffer[] = {0, 0, 0};
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
+    wchar_t wc;
+    int mb_size;
     char cache[4];
-    size_t done = 0, mb_size, ws_size, rune_size;
-    if (s == NULL) {
+    size_t done = 0, used = 0, rune_size;
+    if (locale == NULL || s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        ws_buffer[1] = 0;
-        ws_size = mbstowcs(ws_buffer, s, 1);
-        if (ws_size == (size_t)-1) return (size_t)-1;
-        if ((0xfc00 & ws_buffer[0]) == 0xd800) {
-            /* surrogate pair */
-            ws_size = mbstowcs(ws_buffer, s, 2);
-            if (ws_size == (size_t)-1) return (size_t)-1;
+    while (used < n_bytes && done < count) {
+        UTF8_COUNT(libc_calls, 1);
+        mb_size = _mbtowc_l(&wc, s + used, n_bytes - used, locale);
+        if (mb_size < 0 || (rune_size = utf8_encode(cache, wc)) == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
         }
-        utf16_decode(&rune, ws_buffer, (size_t)-1);
-        rune_size = utf8_encode(cache, rune);
+        if (mb_size == 0) mb_size = 1; /* the 0 character */
         if (rune_size > count - done) break;
         if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-            if (rune_size > 2) *buffer++ = cache[2];
-            if (rune_size > 3) *buffer++ = cache[3];
+            memcpy(buffer, cache, rune_size);
+            buffer += rune_size;
         }
-        if (rune == 0) break;
-        /* recalculate the size in the source string */
-        mb_size = wcstombs(NULL, ws_buffer, (size_t)-1);
-        s += mb_size;
+        used += mb_size;
         done += rune_size;
     }
+    if (parsed != NULL) *parsed = used;
     return done;
 }
 
 #else
 
-size_t utf8_to_wchars(wchar_t *buffer, const char *s, size_t count)
+/*
+Opens the locale of `conv` and stores in `runes` the wide character of each 
+byte (or -1). Returns 0, or -1 if the locale doesn't exist.
+*/
+static int utf8_local_conv_init(utf8_local_conv *conv, const char *name)
+{
+    locale_t previous;
+    mbstate_t state;
+    wchar_t wc;
+    char c;
+    int i;
+    if (name == NULL) conv->locale = duplocale(uselocale((locale_t)0));
+    else conv->locale = newlocale(LC_CTYPE_MASK, name, (locale_t)0);
+    if (conv->locale == (locale_t)0) return -1;
+    /* the locale is installed for the calling thread only */
+    previous = uselocale(conv->locale);
+    conv->single = MB_CUR_MAX == 1;
+    for (i = 0; i < 256; i++) {
+        c = (char)i;
+        wc = 0;
+        memset(&state, 0, sizeof(state));
+        conv->runes[i] = mbrtowc(&wc, &c, 1, &state) < (size_t)-2 ? wc : -1;
+    }
+    uselocale(previous);
+    return 0;
+}
+
+void utf8_local_conv_close(utf8_local_conv *conv)
+{
+    if (conv == NULL) return;
+    freelocale(conv->locale);
+    free(conv);
+}
+
+/* 
+The `_n` functions use the locale installed for the calling thread, which
+`uselocale` changes without affecting the other threads.
+*/
+size_t utf8_to_local_l(locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed)
+{
+    size_t done;
+    locale_t previous;
+    if (locale == (locale_t)0) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    previous = uselocale(locale);
+    done = utf8_to_local_n(buffer, s, n_bytes, count, parsed);
+    uselocale(previous);
+    return done;
+}
+
+size_t utf8_of_local_l(locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed)
+{
+    size_t done;
+    locale_t previous;
+    if (locale == (locale_t)0) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    previous = uselocale(locale);
+    done = utf8_of_local_n(buffer, s, n_bytes, count, parsed);
+    uselocale(previous);
+    return done;
+}
+
+#endif
+
+utf8_local_conv *utf8_local_conv_open(const char *name)
+{
+    utf8_local_conv *conv;
+    size_t slot;
+    int i;
+    conv = malloc(sizeof(*conv));
+    if (conv == NULL) return NULL;
+    if (utf8_local_conv_init(conv, name) != 0) {
+        free(conv);
+        errno = EINVAL;
+        return NULL;
+    }
+    conv->ascii = 1;
+    for (i = 0; i < UTF8_LOCAL_SLOTS; i++) conv->keys[i] = -1;
+    for (i = 0; i < 256; i++) {
+        /* only the valid code points can be encoded in UTF-8 */
+        if (utf8_encode(NULL, conv->runes[i]) == 0) conv->runes[i] = -1;
+        if (i < 0x80 && conv->runes[i] != i) conv->ascii = 0;
+        if (conv->runes[i] < 0 || utf8_local_byte(conv, conv->runes[i]) >= 0)
+            continue;
+        slot = utf8_local_slot(conv->runes[i]);
+        while (conv->keys[slot] != -1) 
+            slot = (slot + 1) & (UTF8_LOCAL_SLOTS - 1);
+        conv->keys[slot] = conv->runes[i];
+        conv->bytes[slot] = (unsigned char)i;
+    }
+    return conv;
+}
+
+size_t utf8_to_local_conv(const utf8_local_conv *conv, char *buffer, 
+    const char *s, size_t n_bytes, size_t count, size_t *parsed)
 {
     int32_t rune;
-    size_t done = 0, parsed;
-    if (s == NULL) {
+    int byte;
+    size_t done = 0, used = 0, rune_size;
+    if (conv == NULL || s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
+    if (!conv->single) 
+        return utf8_to_local_l(conv->locale, buffer, s, n_bytes, count, 
+            parsed);
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = utf8_decode(&rune, s, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
+    while (used < n_bytes && done < count) {
+        if ((0x80 & s[used]) == 0 && conv->ascii) {
+            if (buffer != NULL) buffer[done] = s[used];
+            done += 1;
+            used += 1;
+            UTF8_COUNT(ascii_bytes, 1);
+            continue;
+        }
+        rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+        if (rune_size == 0 || (byte = utf8_local_byte(conv, rune)) < 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
         }
-        if (buffer != NULL) *buffer++ = (wchar_t)rune;
-        if (rune == 0) break;
-        s += parsed;
+        if (buffer != NULL) buffer[done] = (char)byte;
         done += 1;
+        used += rune_size;
     }
+    if (parsed != NULL) *parsed = used;
     return done;
 }
 
-size_t utf8_of_wchars(char *buffer, const wchar_t *p, size_t count)
+size_t utf8_of_local_conv(const utf8_local_conv *conv, char *buffer, 
+    const char *s, size_t n_bytes, size_t count, size_t *parsed)
 {
-    size_t done = 0, rune_size;
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
-    char cache[4];
-    if (p == NULL) {
+    int32_t rune;
+    size_t done = 0, used = 0, rune_size;
+    if (conv == NULL || s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
+    if (!conv->single) 
+        return utf8_of_local_l(conv->locale, buffer, s, n_bytes, count, 
+            parsed);
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        rune_size = utf8_encode(cache, (int32_t)*p);
-        if (rune_size == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
+    while (used < n_bytes && done < count) {
+        rune = conv->runes[(unsigned char)s[used]];
+        if (rune < 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
         }
+        /* the table holds only valid runes */
+        rune_size = 1 + (rune > 0x7f) + (rune > 0x7ff) + (rune > 0xffff);
         if (rune_size > count - done) break;
-        if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-            if (rune_size > 2) *buffer++ = cache[2];
-            if (rune_size > 3) *buffer++ = cache[3];
-        }
-        if (*p == 0) break;
-        p += 1;
+        if (buffer != NULL) utf8_encode(buffer + done, rune);
         done += rune_size;
+        used += 1;
     }
+    if (parsed != NULL) *parsed = used;
     return done;
 }
 
-size_t utf8_to_local(char *buffer, const char *s, size_t count)
+/*
+Works like `utf8_of_ascii_n`. If `until_nul` isn't 0, the conversion stops 
+after a rune 0, escaped or not, which isn't counted in the result.
+*/
+static size_t utf8_of_ascii_until(char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed, int until_nul)
 {
-    int32_t rune[] = {0, 0};
-    size_t done = 0, parsed, mb_size;
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
+    int32_t rune;
+    size_t done = 0, used = 0, ascii_size, rune_size, run;
     char cache[4];
+    int ended = 0;
     if (s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = utf8_decode(rune, s, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
+    while (used < n_bytes && done < count) {
+        /* copy the characters which aren't escaped at once */
+        run = 0;
+        if (s[used] != '\\') run = utf8_plain_run(s + used, n_bytes - used);
+        if (run > count - done) run = count - done;
+        if (run > 0) {
+            if (buffer != NULL) memcpy(buffer + done, s + used, run);
+            used += run;
+            done += run;
+            UTF8_COUNT(ascii_bytes, run);
+            continue;
         }
-        mb_size = wcstombs(cache, rune, (size_t)-1);
-        if (mb_size == (size_t)-1) return (size_t)-1;
-        if (mb_size > count - done) break;
-        if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (mb_size > 1) *buffer++ = cache[1];
-            if (mb_size > 2) *buffer++ = cache[2];
-            if (mb_size > 3) *buffer++ = cache[3];
+        ascii_size = ucs4_decode_ascii(&rune, s + used, n_bytes - used);
+        if (ascii_size == 0) {
+            UTF8_EILSEQ();
+            done = (size_t)-1;
+            break;
+        }
+        if (buffer != NULL && count - done >= 4) {
+            rune_size = utf8_encode(buffer + done, rune);
+        } else { /* encode to the cache, then check if the result fits */
+            rune_size = utf8_encode(cache, rune);
+            if (rune_size > count - done) break;
+            if (buffer != NULL) memcpy(buffer + done, cache, rune_size);
+        }
+        used += ascii_size;
+        done += rune_size;
+        if (rune == 0 && until_nul) {
+            ended = 1;
+            break;
         }
-        if (*rune == 0) break;
-        s += parsed;
-        done += mb_size;
     }
+    if (parsed != NULL) *parsed = used;
+    if (until_nul && done != (size_t)-1 && (ended || used == n_bytes))
+        done -= 1; /* the terminator, plain at `n_bytes` or escaped */
     return done;
 }
 
-size_t utf8_of_local(char *buffer, const char *s, size_t count)
+size_t utf8_of_ascii_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
 {
-    wchar_t ws_buffer[] = {0, 0};
-    size_t done = 0, mb_size, ws_size, rune_size;
-    /* don't write directly to `buffer`, encode in `cache` buffer first, */
-    /* then check if the result fits within `count` output units         */
-    char cache[4];
+    return utf8_of_ascii_until(buffer, s, n_bytes, count, parsed, 0);
+}
+
+size_t utf8_to_ascii_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed)
+{
+    static const char digits[] = "0123456789abcdef";
+    int32_t rune;
+    size_t done = 0, used = 0, rune_size, escape_size, run, i;
+    char cache[10];
     if (s == NULL) {
         errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
         return 0;
     }
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        ws_size = mbstowcs(ws_buffer, s, 1);
-        if (ws_size == (size_t)-1) return (size_t)-1;
-        rune_size = utf8_encode(cache, (int32_t)*ws_buffer);
-        if (rune_size > count - done) break;
-        if (buffer != NULL) {
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-            if (rune_size > 2) *buffer++ = cache[2];
-            if (rune_size > 3) *buffer++ = cache[3];
+    while (used < n_bytes && done < count) {
+        /* copy the characters which don't need an escape at once */
+        run = 0;
+        if ((0x80 & s[used]) == 0 && s[used] != '\\') 
+            run = utf8_plain_run(s + used, n_bytes - used);
+        if (run > count - done) run = count - done;
+        if (run > 0) {
+            if (buffer != NULL) memcpy(buffer + done, s + used, run);
+            used += run;
+            done += run;
+            UTF8_COUNT(ascii_bytes, run);
+            continue;
         }
-        if (*ws_buffer == 0) break;
-        mb_size = wcstombs(NULL, ws_buffer, (size_t)-1);
-        s += mb_size;
-        done += rune_size;
+        cache[0] = '\\';
+        if (s[used] == '\\') {
+            cache[1] = '\\';
+            rune_size = 1;
+            escape_size = 2;
+        } else {
+            rune_size = utf8_decode_dfa(&rune, s + used, n_bytes - used);
+            if (rune_size == 0) {
+                UTF8_EILSEQ();
+                done = (size_t)-1;
+                break;
+            }
+            cache[1] = rune > 0xffff ? 'U' : 'u';
+            escape_size = rune > 0xffff ? 10 : 6;
+            for (i = escape_size - 1; i > 1; i--) {
+                cache[i] = digits[0xf & rune];
+                rune >>= 4;
+            }
+        }
+        if (escape_size > count - done) break;
+        if (buffer != NULL) memcpy(buffer + done, cache, escape_size);
+        used += rune_size;
+        done += escape_size;
     }
+    if (parsed != NULL) *parsed = used;
     return done;
 }
 
-#endif
+/*
+The functions working on zero-terminated strings convert the terminator 
+too, then leave it out of the returned count.
+*/
+
+size_t utf8_to_wchars(wchar_t *buffer, const char *s, size_t count)
+{
+    size_t done, parsed, n_bytes;
+    if (s == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_bytes = strlen(s) + 1;
+    done = utf8_to_wchars_n(buffer, s, n_bytes, count, &parsed);
+    if (done != (size_t)-1 && parsed == n_bytes) done -= 1;
+    return done;
+}
+
+size_t utf8_of_wchars(char *buffer, const wchar_t *p, size_t count)
+{
+    size_t done, parsed, n_wchars;
+    if (p == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_wchars = wcslen(p) + 1;
+    done = utf8_of_wchars_n(buffer, p, n_wchars, count, &parsed);
+    if (done != (size_t)-1 && parsed == n_wchars) done -= 1;
+    return done;
+}
+
+size_t utf8_to_local(char *buffer, const char *s, size_t count)
+{
+    size_t done, parsed, n_bytes;
+    if (s == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_bytes = strlen(s) + 1;
+    done = utf8_to_local_n(buffer, s, n_bytes, count, &parsed);
+    if (done != (size_t)-1 && parsed == n_bytes) done -= 1;
+    return done;
+}
+
+size_t utf8_of_local(char *buffer, const char *s, size_t count)
+{
+    size_t done, parsed, n_bytes;
+    if (s == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_bytes = strlen(s) + 1;
+    done = utf8_of_local_n(buffer, s, n_bytes, count, &parsed);
+    if (done != (size_t)-1 && parsed == n_bytes) done -= 1;
+    return done;
+}
 
 size_t utf8_of_ascii(char *buffer, const char *s, size_t count)
 {
-    int32_t rune;
-    size_t done = 0, parsed, rune_size;
-    char cache[4];
     if (s == NULL) {
         errno = EINVAL;
         return 0;
     }
+    /* an escaped terminator (\x00, \u0000...) ends the string as well */
+    return utf8_of_ascii_until(buffer, s, strlen(s) + 1, count, NULL, 1);
+}
+
+size_t utf8_to_ascii(char *buffer, const char *s, size_t count)
+{
+    size_t done, parsed, n_bytes;
+    if (s == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    n_bytes = strlen(s) + 1;
+    done = utf8_to_ascii_n(buffer, s, n_bytes, count, &parsed);
+    if (done != (size_t)-1 && parsed == n_bytes) done -= 1;
+    return done;
+}
+
+#if defined(_WIN32)
+
+size_t utf8_to_wchars_parallel(wchar_t *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed, unsigned n_threads)
+{
+    (void)n_threads; /* converts in the calling thread */
+    return utf8_to_wchars_n(buffer, s, n_bytes, count, parsed);
+}
+
+#else
+
+/* the smallest part of the input given to a thread */
+#define UTF8_PARALLEL_CHUNK 65536
+#define UTF8_PARALLEL_MAX 256
+
+struct utf8_chunk {
+    const char *s;
+    size_t n_bytes;
+    size_t valid; /* the length of the valid prefix of the chunk */
+    size_t needed; /* the number of wide characters converting it */
+    wchar_t *buffer; /* where to convert the chunk, NULL to count */
+    pthread_t thread;
+    int started; /* the chunk runs in `thread` */
+};
+
+static void *utf8_chunk_run(void *arg)
+{
+    struct utf8_chunk *chunk = arg;
+    int error = errno; /* keep the caller's `errno` */
+    if (chunk->buffer == NULL) {
+        chunk->valid = utf8_valid_prefix(chunk->s, chunk->n_bytes);
+        chunk->needed = utf8_wchars_needed(chunk->s, chunk->valid);
+    } else {
+        utf8_to_wchars_n(chunk->buffer, chunk->s, chunk->n_bytes, 
+            chunk->needed, NULL);
+    }
+    errno = error;
+    return NULL;
+}
+
+/* Runs `chunk_run` on the `n` chunks, in threads but for the first one. */
+static void utf8_chunks_run(struct utf8_chunk *chunks, size_t n)
+{
+    size_t i;
+    for (i = 1; i < n; i++) {
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL, 
+            utf8_chunk_run, chunks + i) == 0;
+        if (!chunks[i].started) utf8_chunk_run(chunks + i);
+    }
+    utf8_chunk_run(chunks);
+    for (i = 1; i < n; i++) {
+        if (chunks[i].started) pthread_join(chunks[i].thread, NULL);
+    }
+}
+
+size_t utf8_to_wchars_parallel(wchar_t *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed, unsigned n_threads)
+{
+    struct utf8_chunk *chunks;
+    size_t i, n, last, start, done, offset = 0, used;
+    if (s == NULL) {
+        errno = EINVAL;
+        if (parsed != NULL) *parsed = 0;
+        return 0;
+    }
+    n = n_threads < UTF8_PARALLEL_MAX ? n_threads : UTF8_PARALLEL_MAX;
+    if (n > n_bytes / UTF8_PARALLEL_CHUNK) n = n_bytes / UTF8_PARALLEL_CHUNK;
+    if (n < 2) return utf8_to_wchars_n(buffer, s, n_bytes, count, parsed);
+    chunks = malloc(n * sizeof(*chunks));
+    if (chunks == NULL) 
+        return utf8_to_wchars_n(buffer, s, n_bytes, count, parsed);
     if (buffer == NULL) count = (size_t)-1;
-    while (done < count) {
-        parsed = ucs4_decode_ascii(&rune, s, (size_t)-1);
-        if (parsed == 0) {
-            errno = EILSEQ;
-            return (size_t)-1;
-        }
-        rune_size = utf8_encode(cache, rune);
-        if (rune_size > count - done) break;
-        if (buffer != NULL) { /* copy the cache */
-            *buffer++ = cache[0];
-            if (rune_size > 1) *buffer++ = cache[1];
-            if (rune_size > 2) *buffer++ = cache[2];
-            if (rune_size > 3) *buffer++ = cache[3];
-        }
-        if (rune == 0) break;
-        s += parsed;
-        done += rune_size;
+    /* 
+    Cut before a byte which isn't a continuation byte, so no valid sequence
+    is split. After more than 3 continuation bytes the text is invalid 
+    before the cut and the error is found in the previous chunk.
+    */
+    start = 0;
+    for (i = 0; i < n; i++) {
+        last = i + 1 < n ? n_bytes / n * (i + 1) : n_bytes;
+        for (done = 0; done < 3 && last < n_bytes && 
+            (0xc0 & s[last]) == 0x80; done++) last++;
+        chunks[i].s = s + start;
+        chunks[i].n_bytes = last - start;
+        chunks[i].buffer = NULL;
+        start = last;
+    }
+    /* count the wide characters of each chunk */
+    utf8_chunks_run(chunks, n);
+    /* 
+    The chunks are converted at the sum of the sizes of the previous ones, 
+    up to the chunk in which `count` is reached or an error is found, which
+    is converted by `utf8_to_wchars_n` to get the same result as converting
+    sequentially.
+    */
+    for (last = 0; last < n; last++) {
+        if (chunks[last].valid < chunks[last].n_bytes || 
+            chunks[last].needed > count - offset) break;
+        chunks[last].buffer = buffer == NULL ? NULL : buffer + offset;
+        offset += chunks[last].needed;
     }
+    if (buffer != NULL && last > 0) utf8_chunks_run(chunks, last);
+    if (last == n) {
+        used = n_bytes;
+        done = offset;
+    } else {
+        done = utf8_to_wchars_n(buffer == NULL ? NULL : buffer + offset, 
+            chunks[last].s, chunks[last].n_bytes, count - offset, &used);
+        used += (size_t)(chunks[last].s - s);
+        if (done != (size_t)-1) done += offset;
+    }
+    free(chunks);
+    if (parsed != NULL) *parsed = used;
     return done;
 }
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef __VT_UTF8_H__
 #define __VT_UTF8_H__
 
+#include <locale.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,6 +16,9 @@ Returns -1 if the end-of-file has been reached.
 The variable `errno` is set to EILSEQ if an invalid or incomplete sequence 
 was found, or to the last error code set by the standard library function 
 `fgetc`.
+The bytes of an invalid sequence are read up to the first byte which can't
+continue it (the maximal subpart), a lone byte being read if it can't start
+a sequence, so the next call starts with the byte that broke the sequence.
 */
 int32_t utf8_get_rune(FILE *input);
 
@@ -24,20 +28,169 @@ encoding `rune`.
 Returns the value of `rune` in the absence of error.
 Returns -1 if the operation fails. The `errno` variable is set to
 EILSEQ if `rune` isn't a valid code point or to the last error code set by
-the standard library function `fputc`.
+the standard library function `fwrite`.
 */
 int32_t utf8_put_rune(int32_t rune, FILE *output);
 
+/*
+`utf8_reader` reads runes from a stream or a file descriptor through its own
+buffer, so the bytes are fetched in large blocks and not one at a time. The
+reader reads ahead: the bytes it buffered are no longer available to the
+other functions reading the same stream.
+*/
+typedef struct utf8_reader utf8_reader;
+
+/*
+`utf8_reader_open` creates a reader for the readable stream `input`, and 
+`utf8_reader_open_fd` one for the readable file descriptor `fd`.
+Returns the reader, to be released with `utf8_reader_close`.
+Returns NULL and sets the global variable `errno` if the reader can't be 
+created.
+*/
+utf8_reader *utf8_reader_open(FILE *input);
+utf8_reader *utf8_reader_open_fd(int fd);
+
+/*
+`utf8_reader_close` releases `reader`. The stream or the file descriptor
+isn't closed.
+*/
+void utf8_reader_close(utf8_reader *reader);
+
+/*
+`utf8_reader_next` gets the next rune from `reader`.
+Returns the rune.
+Returns 0xfffd and sets the variable `errno` to EILSEQ if the next 
+characters don't form a valid UTF-8 sequence. The invalid bytes are skipped
+like in `utf8_get_rune`.
+Returns -1 if the end of the input has been reached or reading failed (see
+`utf8_reader_error`).
+*/
+int32_t utf8_reader_next(utf8_reader *reader);
+
+/*
+`utf8_reader_read_runes` gets up to `n` runes from `reader` and stores them
+at the address given by `out`, as `utf8_reader_next` would.
+Returns the number of runes stored, less than `n` only if the end of the 
+input has been reached or reading failed.
+*/
+size_t utf8_reader_read_runes(utf8_reader *reader, int32_t *out, size_t n);
+
+/*
+`utf8_reader_error` returns the error code of the failed read which ended
+the input of `reader`, or 0 if there was none.
+*/
+int utf8_reader_error(const utf8_reader *reader);
+
+/*
+`utf8_writer` writes runes to a stream or a file descriptor through its own
+buffer, which is written with a single `fwrite` or `write` call when full or
+when flushed.
+*/
+typedef struct utf8_writer utf8_writer;
+
+/*
+`utf8_writer_open` creates a writer for the writable stream `output`, and 
+`utf8_writer_open_fd` one for the writable file descriptor `fd`.
+Returns the writer, to be released with `utf8_writer_close`.
+Returns NULL and sets the global variable `errno` if the writer can't be 
+created.
+*/
+utf8_writer *utf8_writer_open(FILE *output);
+utf8_writer *utf8_writer_open_fd(int fd);
+
+/*
+`utf8_writer_close` flushes and releases `writer`. The stream or the file 
+descriptor isn't closed.
+Returns 0, or -1 if the buffered bytes couldn't be written.
+*/
+int utf8_writer_close(utf8_writer *writer);
+
+/*
+`utf8_writer_put_rune` buffers in `writer` the UTF-8 bytes encoding `rune`.
+Returns the value of `rune` in the absence of error.
+Returns -1 if the operation fails. The `errno` variable is set to EILSEQ if
+`rune` isn't a valid code point or to the error code of the failed write.
+*/
+int32_t utf8_writer_put_rune(utf8_writer *writer, int32_t rune);
+
+/*
+`utf8_writer_put_runes` buffers in `writer` the UTF-8 bytes encoding the
+`n` runes at the address given by `runes`.
+Returns the number of runes buffered, less than `n` if a rune isn't a valid
+code point (`errno` is set to EILSEQ) or if writing failed.
+*/
+size_t utf8_writer_put_runes(utf8_writer *writer, const int32_t *runes, 
+    size_t n);
+
+/*
+`utf8_writer_flush` writes the bytes buffered in `writer` and flushes its
+stream.
+Returns 0, or -1 if writing failed.
+*/
+int utf8_writer_flush(utf8_writer *writer);
+
+/*
+`utf8_writer_error` returns the error code of the first failed write of 
+`writer`, or 0 if there was none. A writer stops writing after an error.
+*/
+int utf8_writer_error(const utf8_writer *writer);
+
 /*
 `utf8_decode` writes at the address given by `rune` the code point obtained 
 from parsing at most `n_bytes` characters of the zero-ending string `s`.
 Returns the number of characters parsed.
 Returns 0 if the first characters within `n_bytes` don't form a valid UTF-8 
-sequence or the resulting code point is invalid.
+sequence or the resulting code point is invalid (the surrogate range is not
+valid).
 The source pointer `s` can't be NULL.
 */
 size_t utf8_decode(int32_t *rune, const char *s, size_t n_bytes);
 
+/*
+`utf8_decoder` holds the state of a decoding spread over several chunks of 
+input, like the bytes received from a socket: the start of a sequence cut
+at the end of a chunk is kept in the state and completed by the next chunk.
+The fields are private, the structure is public so a decoder needs no 
+allocation. `utf8_decoder_init` sets a decoder to the initial state.
+*/
+typedef struct utf8_decoder {
+    uint32_t state; /* the state of the automaton */
+    int32_t value; /* the bits of the code point decoded so far */
+    size_t pending; /* the number of bytes of the cut sequence */
+} utf8_decoder;
+
+void utf8_decoder_init(utf8_decoder *decoder);
+
+/*
+`utf8_decoder_feed` decodes the `len` bytes at the address given by `chunk`
+after the bytes kept by `decoder`, writing at the address given by `out` 
+(when not NULL) up to `cap` runes. The bytes of valid sequences are read 
+once, those of a sequence cut at the end of `chunk` being consumed and kept 
+in the state. Only the byte breaking an invalid sequence is read again, as 
+the start of the next sequence (by the same call, or by the next one if the
+error is reported there).
+Returns the number of runes written (or decoded if `out` is NULL) and 
+stores at the address given by `parsed` (when not NULL) the number of bytes
+of `chunk` consumed, less than `len` if `cap` runes were written.
+An invalid sequence stops the decoding: its bytes (the maximal subpart) are
+consumed and the error is reported by the call which meets it if no rune 
+was decoded before it, otherwise by the next call. The call reporting it
+returns (size_t)-1, sets the global variable `errno` to EILSEQ and resets
+`decoder`, so the decoding may go on after the consumed bytes.
+Returns 0 and sets the global variable `errno` to EINVAL if `chunk` is NULL.
+*/
+size_t utf8_decoder_feed(utf8_decoder *decoder, const char *chunk, 
+    size_t len, int32_t *out, size_t cap, size_t *parsed);
+
+/*
+`utf8_decoder_pending` returns the number of bytes of a sequence cut at the
+end of the last chunk and kept by `decoder`, or (size_t)-1 if an invalid 
+sequence is left to be reported by the next call of `utf8_decoder_feed`. 
+A decoder for which it doesn't return 0 at the end of the input has met an 
+invalid or incomplete sequence, without a last call with `len` 0.
+*/
+size_t utf8_decoder_pending(const utf8_decoder *decoder);
+
 /*
 `utf8_encode` writes at the address given by `p` the UTF-8 sequence encoding
 `rune`.
@@ -47,6 +200,137 @@ valid).
 */
 size_t utf8_encode(char *p, int32_t rune);
 
+/*
+`utf8_encode_runes` writes at the address given by `dst` the UTF-8 sequences
+encoding the `n` runes at the address given by `src`, using SIMD shuffles
+for the runes below U+10000 when the processor supports them. `dst` must 
+have room for all the bytes, at most 4 * `n`.
+Returns the number of bytes written, or needed if `dst` is NULL.
+Returns (size_t)-1 and sets the global variable `errno` to EILSEQ if one of
+the runes is not a valid code point, in which case the content of `dst` is
+unspecified.
+Returns 0 and sets the global variable `errno` to EINVAL if `src` is NULL.
+*/
+size_t utf8_encode_runes(char *dst, const int32_t *src, size_t n);
+
+/*
+`utf8_decode_runes` writes at the address given by `dst` the runes decoded 
+from the `len` bytes at the address given by `src`, the inverse of 
+`utf8_encode_runes`, using SIMD shuffles for the blocks of ASCII characters
+and of sequences of the same length when the processor supports them. 
+`dst` must have room for all the runes, at most `len`.
+Returns the number of runes written, or needed if `dst` is NULL, and stores
+at the address given by `consumed` (when not NULL) the number of bytes 
+decoded.
+Returns (size_t)-1 and sets the global variable `errno` to EILSEQ if `src` 
+holds an invalid or incomplete sequence, in which case `consumed` receives
+its offset and `dst` holds the runes decoded before it.
+Returns 0 and sets the global variable `errno` to EINVAL if `src` is NULL.
+*/
+size_t utf8_decode_runes(int32_t *dst, const char *src, size_t len, 
+    size_t *consumed);
+
+/*
+`utf8_count_runes` returns the number of runes in the `n_bytes` characters
+of valid UTF-8 at the address given by `s`, counting the bytes which aren't
+continuation bytes (0x80...0xbf) without decoding. The result is meaningful
+only for valid input (see `utf8_validate`).
+Returns 0 and sets the global variable `errno` to EINVAL if `s` is NULL.
+*/
+size_t utf8_count_runes(const char *s, size_t n_bytes);
+
+/*
+`utf8_wchars_needed` returns the number of wide characters converting the
+`n_bytes` characters of valid UTF-8 at the address given by `s`, counting 
+the runes and, where wchar_t is 16-bit, the 4-byte sequences needing a 
+surrogate pair. The result is meaningful only for valid input.
+Returns 0 and sets the global variable `errno` to EINVAL if `s` is NULL.
+*/
+size_t utf8_wchars_needed(const char *s, size_t n_bytes);
+
+/*
+`utf8_bytes_needed_for_wchars` returns the number of bytes of the UTF-8 
+conversion of the `n_wchars` wide characters at the address given by `p`, 
+from the ranges of the values, without encoding.
+Returns (size_t)-1 and sets the global variable `errno` to EILSEQ if the 
+wide characters aren't valid UTF-32 (or UTF-16 with 16-bit wchar_t).
+Returns 0 and sets the global variable `errno` to EINVAL if `p` is NULL.
+*/
+size_t utf8_bytes_needed_for_wchars(const wchar_t *p, size_t n_wchars);
+
+/*
+`utf8_index` gives random access by rune offset to a UTF-8 buffer. It 
+records the byte offset of every `stride`-th rune (and its UTF-16 offset if
+requested), using about 1 / `stride` of a `size_t` per rune, or twice that
+with the UTF-16 offsets. The buffer isn't stored by the index: it's passed
+to every call, so it may move when it grows. A rune starts at every byte 
+which isn't a continuation byte (0x80...0xbf), like for `utf8_count_runes`,
+so the offsets are meaningful only for valid UTF-8.
+*/
+typedef struct utf8_index utf8_index;
+
+/* The flag requesting the UTF-16 offsets. */
+#define UTF8_INDEX_UTF16 1
+
+/*
+`utf8_index_open` creates an empty index recording a checkpoint every 
+`stride` runes: the lookups read up to `stride` runes from a checkpoint.
+`flags` is 0 or UTF8_INDEX_UTF16.
+Returns NULL and sets the global variable `errno` to EINVAL if `stride` is
+0, or to ENOMEM if there's not enough memory.
+*/
+utf8_index *utf8_index_open(size_t stride, int flags);
+
+/*
+`utf8_index_close` releases `index`. `index` may be NULL.
+*/
+void utf8_index_close(utf8_index *index);
+
+/*
+`utf8_index_extend` indexes the bytes of the buffer `s` of `n_bytes` 
+characters following the ones already indexed, after bytes have been 
+appended to the buffer. The first call indexes the whole buffer. A sequence
+may be split between two calls.
+Returns 0, or -1 and sets the global variable `errno` to EINVAL if `n_bytes`
+is less than the number of bytes already indexed, or to ENOMEM if there's 
+not enough memory.
+*/
+int utf8_index_extend(utf8_index *index, const char *s, size_t n_bytes);
+
+/*
+`utf8_index_runes` returns the number of runes in the bytes indexed.
+*/
+size_t utf8_index_runes(const utf8_index *index);
+
+/*
+`utf8_index_byte_of_rune` returns the byte offset of the rune `rune` in the
+buffer `s`, or the number of bytes indexed if `rune` is the number of runes.
+`utf8_index_rune_of_byte` returns the offset of the rune holding the byte 
+`byte` of the buffer `s` (in O(log n) plus at most `stride` runes).
+`utf8_index_utf16_of_rune` returns the number of UTF-16 units encoding the
+runes before `rune`, if the index records the UTF-16 offsets.
+They return (size_t)-1 and set the global variable `errno` to EINVAL if the
+offset is beyond the bytes indexed or the UTF-16 offsets aren't recorded.
+*/
+size_t utf8_index_byte_of_rune(const utf8_index *index, const char *s, 
+    size_t rune);
+size_t utf8_index_rune_of_byte(const utf8_index *index, const char *s, 
+    size_t byte);
+size_t utf8_index_utf16_of_rune(const utf8_index *index, const char *s, 
+    size_t rune);
+
+/*
+`utf8_validate` checks the `n_bytes` characters at the address given by `s`, 
+accepting exactly the sequences accepted by `utf8_decode`. The input doesn't
+need to end in 0 and may contain zero characters.
+Returns the length of the longest prefix made of complete valid sequences, 
+that is `n_bytes` if the whole input is valid UTF-8.
+Sets the global variable `errno` to EILSEQ if the returned value is less
+than `n_bytes`.
+Returns 0 and sets the global variable `errno` to EINVAL if `s` is NULL.
+*/
+size_t utf8_validate(const char *s, size_t n_bytes);
+
 /*
 `utf8_to_wchars` writes at the address given by `buffer` (when not NULL) up 
 to `count` wide characters converted from the valid UTF-8 characters of the 
@@ -105,6 +389,7 @@ backslash, so `\\uDDDD` is interpreted as '\', 'u', 'D', 'D', 'D', 'D' and
 not translated to UTF-8. A backslash followed by any other character is
 written as it is to the output buffer.
 Partial sequences are not converted.
+An escaped rune 0 (`\x00`, `\u0000`...) ends the string like its terminator.
 Returns the number of non-zero bytes written (even if `buffer` 
 is NULL).
 Returns 0 if the string `s` is empty ("\0").
@@ -114,4 +399,266 @@ non-ASCII characters in the input (> 127).
 */
 size_t utf8_of_ascii(char *buffer, const char *s, size_t count);
 
+/*
+`utf8_to_ascii` writes at the address given by `buffer` (when not NULL) up 
+to `count` ASCII characters converted from the UTF-8 characters of the 
+zero-terminated string `s`, the reverse of `utf8_of_ascii`.
+The runes above 0x7f are written as `\uDDDD`, or as `\UDDDDDDDD` above 
+0xffff, with lowercase hexadecimal digits, and the backslash is doubled, 
+so `utf8_of_ascii` gives back the string `s`. The other ASCII characters 
+are copied unchanged. An escape which doesn't fit in `count` isn't written.
+Returns the number of non-zero characters written (even if `buffer` is 
+NULL).
+Returns 0 if the string `s` is empty ("\0").
+Returns 0 and sets the global variable `errno` to EINVAL if `s` is NULL.
+Returns (size_t)-1 if `s` isn't valid UTF-8.
+*/
+size_t utf8_to_ascii(char *buffer, const char *s, size_t count);
+
+/*
+The functions ending in `_n` convert exactly `n_bytes` characters (or 
+`n_wchars` wide characters) from the address given by the source pointer, 
+without looking for a terminator: zero characters are converted like any 
+other character and no terminator is added.
+They write at the address given by `buffer` (when not NULL) up to `count`
+output units. Partial sequences are not converted.
+They return the number of output units written (even if `buffer` is NULL)
+and store at the address given by `parsed` (when not NULL) the number of
+source units converted.
+They return (size_t)-1 and set the global variable `errno` to EILSEQ if the 
+source contains an invalid or incomplete sequence or can't be converted, in
+which case `parsed` receives the offset of that sequence and `buffer` holds
+the units converted before it.
+They return 0 and set the global variable `errno` to EINVAL if the source 
+pointer is NULL.
+*/
+size_t utf8_to_wchars_n(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_of_wchars_n(char *buffer, const wchar_t *p, size_t n_wchars,
+    size_t count, size_t *parsed);
+size_t utf8_to_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_of_local_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_of_ascii_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_to_ascii_n(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+
+/*
+`utf8_to_utf16` and `utf8_of_utf16` convert between UTF-8 and UTF-16 in 
+the byte order of the platform, on every platform (`wchar_t` is UTF-32 on 
+most systems but Windows). A `char16_t` buffer may be passed for the 
+`uint16_t` one. They work like the functions ending in `_n`, `n_units` and 
+`count` counting 16-bit units on the UTF-16 side. A rune above U+FFFF takes
+a surrogate pair, written whole or not at all; a surrogate which isn't part
+of a pair is an invalid sequence.
+*/
+size_t utf8_to_utf16(uint16_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_of_utf16(char *buffer, const uint16_t *p, size_t n_units,
+    size_t count, size_t *parsed);
+
+/*
+`utf8_of_latin1` and `utf8_to_latin1` convert between UTF-8 and ISO-8859-1
+(Latin-1), whose characters are the runes U+0000...U+00FF, without the 
+locale. They work like the functions ending in `_n`. 
+`utf8_of_latin1` never fails, every byte being a Latin-1 character.
+`utf8_to_latin1` writes the byte `replacement` for each rune above U+00FF,
+or fails on it like on an invalid sequence if `replacement` is negative.
+A `replacement` above 0xff is an error (EINVAL).
+*/
+size_t utf8_of_latin1(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed);
+size_t utf8_to_latin1(char *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed, int replacement);
+
+/*
+`utf8_to_wchars_lossy` and `utf8_repair` convert like `utf8_to_wchars_n`
+(to wide characters) and like copying (to UTF-8), in a single pass, 
+replacing each invalid or incomplete sequence with U+FFFD instead of 
+failing. The bytes replaced by one U+FFFD are the maximal subpart of the
+sequence, the longest start of a valid sequence or else one byte, like 
+`utf8_get_rune` and the WHATWG Encoding Standard do.
+They write at the address given by `buffer` (when not NULL) up to `count` 
+output units, return the number of output units written (even if `buffer` 
+is NULL) and store at the address given by `parsed` (when not NULL) the 
+number of bytes converted and at the address given by `first_error` (when 
+not NULL) the offset of the first invalid sequence met, or `n_bytes` if
+there was none.
+They return 0 and set the global variable `errno` to EINVAL if `s` is NULL.
+*/
+size_t utf8_to_wchars_lossy(wchar_t *buffer, const char *s, size_t n_bytes,
+    size_t count, size_t *parsed, size_t *first_error);
+size_t utf8_repair(char *buffer, const char *s, size_t n_bytes, size_t count,
+    size_t *parsed, size_t *first_error);
+
+/*
+`utf8_allocator` supplies the memory of the functions ending in `_alloc`. 
+`alloc` returns `size` bytes aligned like `malloc` does (or NULL), `resize`
+works like `realloc`, being given the old size, and `release` works like 
+`free`, being given the size. Each function receives `ctx` first.
+A NULL allocator stands for `malloc`, `realloc` and `free`.
+*/
+typedef struct utf8_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*resize)(void *ctx, void *p, size_t old_size, size_t size);
+    void (*release)(void *ctx, void *p, size_t size);
+    void *ctx;
+} utf8_allocator;
+
+/*
+`utf8_to_wchars_alloc` and `utf8_of_wchars_alloc` convert the `n_bytes` 
+characters at `s` to wide characters, or the `n_wchars` wide characters at 
+`p` to UTF-8, in a single pass into a buffer from `allocator` holding the 
+result and a terminator: the buffer is allocated for the longest result, 
+then shrunk to the result.
+They return the buffer and store at the address given by the last argument
+(when not NULL) the number of output units, the terminator excluded.
+They return NULL and set the global variable `errno` to EILSEQ if the 
+source contains an invalid or incomplete sequence, to ENOMEM if there's not
+enough memory, or to EINVAL if the source pointer is NULL.
+The buffer must be released with `allocator`.
+*/
+wchar_t *utf8_to_wchars_alloc(const utf8_allocator *allocator, 
+    const char *s, size_t n_bytes, size_t *n_wchars);
+char *utf8_of_wchars_alloc(const utf8_allocator *allocator, 
+    const wchar_t *p, size_t n_wchars, size_t *n_bytes);
+
+/*
+`utf8_arena` is a bump allocator for batches of conversions: it hands out 
+memory from large blocks and releases it all at once. The last allocation
+is resized or released in place, so the buffers of the `_alloc` functions
+shrink without being copied.
+*/
+typedef struct utf8_arena utf8_arena;
+
+/*
+`utf8_arena_open` creates an arena getting its blocks from `malloc`, of 
+`block_size` bytes, or of 64 KiB if `block_size` is 0, or larger for the
+allocations not fitting in a block.
+Returns NULL and sets the global variable `errno` to ENOMEM if there's not 
+enough memory.
+*/
+utf8_arena *utf8_arena_open(size_t block_size);
+
+/*
+`utf8_arena_reset` releases all the memory handed out by `arena`, keeping 
+its blocks for the next allocations.
+*/
+void utf8_arena_reset(utf8_arena *arena);
+
+/*
+`utf8_arena_close` frees `arena` and its blocks. `arena` may be NULL.
+*/
+void utf8_arena_close(utf8_arena *arena);
+
+/*
+`utf8_arena_allocator` returns an allocator taking its memory from `arena`.
+*/
+utf8_allocator utf8_arena_allocator(utf8_arena *arena);
+
+/*
+`utf8_to_wchars_parallel` works like `utf8_to_wchars_n`, using up to
+`n_threads` threads for the inputs of at least 64 KiB per thread. The input
+is cut in chunks before bytes which aren't continuation bytes, the size of
+each chunk is counted in parallel, then the chunks are converted in 
+parallel at the offsets given by the sizes. The result, the offset stored
+at `parsed` and the first wide characters of `buffer`, as many as the 
+result (or converted before the first invalid sequence), are the same as 
+with `utf8_to_wchars_n`. The units of `buffer` past them may differ.
+The conversion runs in the calling thread on Windows.
+*/
+size_t utf8_to_wchars_parallel(wchar_t *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed, unsigned n_threads);
+
+/*
+`utf8_local_conv` converts between UTF-8 and the multibyte encoding of a
+locale, looked up once when the converter is opened. The converter of a 
+single-byte locale (ISO-8859-x, CP125x...) converts with lookup tables, the 
+converter of a multibyte locale with `mbrtowc` and `wcrtomb` in the locale.
+*/
+typedef struct utf8_local_conv utf8_local_conv;
+
+/*
+`utf8_local_conv_open` creates a converter for the encoding (LC_CTYPE) of the 
+locale named `name`, or of the current locale if `name` is NULL.
+Returns NULL and sets the global variable `errno` to EINVAL if the locale 
+doesn't exist, or to ENOMEM if there's not enough memory.
+*/
+utf8_local_conv *utf8_local_conv_open(const char *name);
+
+/*
+`utf8_local_conv_close` releases `conv`. `conv` may be NULL.
+*/
+void utf8_local_conv_close(utf8_local_conv *conv);
+
+/*
+`utf8_to_local_conv` and `utf8_of_local_conv` work like `utf8_to_local_n` 
+and `utf8_of_local_n`, in the locale of `conv` instead of the current one.
+The converter isn't changed by the conversions, so it may be shared by any
+number of threads.
+They return 0 and set the global variable `errno` to EINVAL if `conv` is
+NULL.
+*/
+size_t utf8_to_local_conv(const utf8_local_conv *conv, char *buffer, 
+    const char *s, size_t n_bytes, size_t count, size_t *parsed);
+size_t utf8_of_local_conv(const utf8_local_conv *conv, char *buffer, 
+    const char *s, size_t n_bytes, size_t count, size_t *parsed);
+
+/*
+`utf8_to_local_l` and `utf8_of_local_l` work like `utf8_to_local_n` and 
+`utf8_of_local_n`, in the locale `locale` instead of the current one. The 
+locale is installed only for the calling thread during the call, so the 
+threads may convert in different locales at the same time without changing
+the global locale.
+They return 0 and set the global variable `errno` to EINVAL if `locale` is
+0. They are declared where `locale_t` is available (POSIX.1-2008), or with 
+`_locale_t` on Windows.
+*/
+#if defined(_WIN32)
+size_t utf8_to_local_l(_locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed);
+size_t utf8_of_local_l(_locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed);
+#elif defined(LC_GLOBAL_LOCALE)
+size_t utf8_to_local_l(locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed);
+size_t utf8_of_local_l(locale_t locale, char *buffer, const char *s, 
+    size_t n_bytes, size_t count, size_t *parsed);
+#endif
+
+/*
+`utf8_stats` holds the counters of the hot paths of the library, kept when 
+it's compiled with the macro UTF8_STATS defined:
+`ascii_bytes` the bytes converted by the ASCII fast paths (the runs of ASCII
+characters copied or widened without decoding),
+`decoded` and `encoded` the runes decoded and encoded one at a time (by 
+`utf8_decode`, `utf8_encode` and the scalar loops of the library), by length
+in bytes (the first item counts the 1-byte sequences),
+`errors` the invalid or incomplete sequences and the invalid runes found 
+(the errors reported with EILSEQ, one per failed call),
+`libc_calls` the calls to the C library converting a character from or to 
+the encoding of a locale (`mbrtowc`, `wcrtomb`...).
+*/
+typedef struct utf8_stats {
+    size_t ascii_bytes;
+    size_t decoded[4];
+    size_t encoded[4];
+    size_t errors;
+    size_t libc_calls;
+} utf8_stats;
+
+/*
+`utf8_stats_get` stores at the address given by `stats` the sum of the 
+counters of all the threads, the threads which ended included, and 
+`utf8_stats_reset` sets them to 0. Each thread counts in its own counters, 
+so the conversions don't share memory, and the sum is exact when no other 
+thread converts during the call.
+Without UTF8_STATS the counters don't exist: `utf8_stats_get` stores 0 in
+all the fields and the conversions cost nothing more.
+*/
+void utf8_stats_get(utf8_stats *stats);
+void utf8_stats_reset(void);
+
 #endif
@@ -0,0 +1,354 @@
+#ifndef __VT_UTF8_HPP__
+#define __VT_UTF8_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
+
+/*
+The C++ layer of the library, header-only (C++17): the functions are
+`constexpr` and defined here, so they're evaluated at compile time when
+their arguments are constants and inlined in the loops of the callers
+otherwise. It doesn't need `utf8.c`, which holds the bulk conversions.
+*/
+namespace utf8 {
+
+/*
+`replacement` is the rune standing for an invalid sequence, U+FFFD.
+*/
+constexpr int32_t replacement = 0xfffd;
+
+/*
+`decode` works like `utf8_decode`: writes at the address given by `rune`
+(when not NULL) the code point obtained from parsing at most `n_bytes`
+characters at `s`.
+Returns the number of characters parsed.
+Returns 0 if the first characters within `n_bytes` don't form a valid UTF-8
+sequence or the resulting code point is invalid. The sequences accepted are
+the ones accepted by `utf8_decode`: no overlong forms, no surrogates,
+nothing above U+10FFFF.
+*/
+constexpr std::size_t decode(int32_t *rune, const char *s,
+    std::size_t n_bytes) noexcept
+{
+    unsigned char c = 0, lo = 0x80, hi = 0xbf;
+    int32_t value = 0;
+    std::size_t i = 0, size = 0;
+    if (n_bytes < 1) return 0;
+    c = static_cast<unsigned char>(s[0]);
+    if (c < 0x80) {
+        if (rune != nullptr) *rune = c;
+        return 1;
+    }
+    if (c < 0xc2 || c > 0xf4) return 0;
+    if (c < 0xe0) {
+        size = 2;
+        value = c & 0x1f;
+    } else if (c < 0xf0) {
+        size = 3;
+        value = c & 0x0f;
+        if (c == 0xe0) lo = 0xa0; /* overlong */
+        if (c == 0xed) hi = 0x9f; /* surrogate */
+    } else {
+        size = 4;
+        value = c & 0x07;
+        if (c == 0xf0) lo = 0x90; /* overlong */
+        if (c == 0xf4) hi = 0x8f; /* above U+10FFFF */
+    }
+    if (n_bytes < size) return 0; /* not enough bytes left */
+    /* only the second byte has a narrower range */
+    c = static_cast<unsigned char>(s[1]);
+    if (c < lo || c > hi) return 0;
+    value = (value << 6) | (c & 0x3f);
+    for (i = 2; i < size; i++) {
+        c = static_cast<unsigned char>(s[i]);
+        if ((c & 0xc0) != 0x80) return 0;
+        value = (value << 6) | (c & 0x3f);
+    }
+    if (rune != nullptr) *rune = value;
+    return size;
+}
+
+constexpr std::size_t decode(int32_t *rune, std::string_view s) noexcept
+{
+    return decode(rune, s.data(), s.size());
+}
+
+/*
+`sequence_size` returns the number of bytes of the sequence starting at `s`,
+within `n_bytes`: the whole sequence if it's valid, else its maximal subpart
+(the lead byte and the bytes continuing it validly), at least 1. It's the 
+number of bytes `utf8_get_rune` and `utf8_to_wchars_lossy` read for a rune
+or a U+FFFD. Returns 0 if `n_bytes` is 0.
+*/
+constexpr std::size_t sequence_size(const char *s,
+    std::size_t n_bytes) noexcept
+{
+    unsigned char c = 0, lo = 0x80, hi = 0xbf;
+    std::size_t i = 1, size = 0;
+    if (n_bytes < 1) return 0;
+    c = static_cast<unsigned char>(s[0]);
+    if (c < 0xc2 || c > 0xf4) return 1; /* ASCII or an invalid byte */
+    size = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    if (c == 0xe0) lo = 0xa0; /* overlong */
+    if (c == 0xed) hi = 0x9f; /* surrogate */
+    if (c == 0xf0) lo = 0x90; /* overlong */
+    if (c == 0xf4) hi = 0x8f; /* above U+10FFFF */
+    for (i = 1; i < size && i < n_bytes; i++) {
+        c = static_cast<unsigned char>(s[i]);
+        if (c < lo || c > hi) break;
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return i;
+}
+
+/*
+`encoded_size` returns the number of bytes of the UTF-8 sequence encoding
+`rune`, or 0 if `rune` isn't a valid code point (the surrogates aren't).
+*/
+constexpr std::size_t encoded_size(int32_t rune) noexcept
+{
+    if (rune < 0 || rune > 0x10ffff) return 0;
+    if (rune >= 0xd800 && rune <= 0xdfff) return 0;
+    return 1 + (rune > 0x7f) + (rune > 0x7ff) + (rune > 0xffff);
+}
+
+/*
+`encode` works like `utf8_encode`: writes at the address given by `p` (when
+not NULL) the UTF-8 sequence encoding `rune`.
+Returns the number of characters used, even if `p` is NULL.
+Returns 0 if `rune` is not a valid code point.
+*/
+constexpr std::size_t encode(char *p, int32_t rune) noexcept
+{
+    std::size_t i = 0, size = encoded_size(rune);
+    if (p == nullptr || size == 0) return size;
+    if (size == 1) {
+        p[0] = static_cast<char>(rune);
+        return 1;
+    }
+    for (i = size - 1; i > 0; i--) {
+        p[i] = static_cast<char>(0x80 | (0x3f & rune));
+        rune >>= 6;
+    }
+    p[0] = static_cast<char>((0xf00 >> size) | rune);
+    return size;
+}
+
+/*
+`literal` holds the UTF-8 encoding of a string of runes, built by `encode`
+at compile time when the string is a constant. `N` is the capacity in
+bytes, enough for the longest encoding; `size` is the number of bytes used.
+The bytes are followed by a 0, so `c_str` is a zero-terminated string.
+*/
+template <std::size_t N>
+struct literal {
+    char bytes[N + 1] = {};
+    std::size_t size = 0;
+
+    constexpr const char *c_str() const noexcept { return bytes; }
+    constexpr std::string_view view() const noexcept
+    {
+        return std::string_view(bytes, size);
+    }
+    constexpr operator std::string_view() const noexcept { return view(); }
+};
+
+/*
+`encode` returns the UTF-8 encoding of the runes of the string `s`, up to
+its terminating 0, each invalid rune being replaced by U+FFFD:
+
+    constexpr auto greeting = utf8::encode(U"Γειά σου");
+    static_assert(greeting.size == 15);
+
+*/
+template <std::size_t N>
+constexpr literal<4 * (N - 1)> encode(const char32_t (&s)[N]) noexcept
+{
+    literal<4 * (N - 1)> result;
+    std::size_t i = 0, size = 0;
+    for (i = 0; i + 1 < N; i++) {
+        size = encode(result.bytes + result.size, static_cast<int32_t>(s[i]));
+        if (size == 0)
+            size = encode(result.bytes + result.size, replacement);
+        result.size += size;
+    }
+    return result;
+}
+
+/*
+`rune_view` reads the runes of UTF-8 bytes viewed through a
+`std::string_view`, without copying them: the iterators decode the runes
+where they are. The iterators are bidirectional, so the view can be given
+to the algorithms of `<algorithm>` and, with C++20, to the ones of
+`<ranges>`. An invalid sequence reads as one U+FFFD per maximal subpart 
+(see `sequence_size`), like with `utf8_to_wchars_lossy`, the same runes 
+being read forwards and backwards.
+*/
+class rune_view {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = int32_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = int32_t;
+
+        constexpr iterator() noexcept = default;
+        constexpr iterator(const char *first, const char *p,
+            const char *last) noexcept : first_(first), p_(p), last_(last)
+        {
+        }
+
+        /* the address of the first byte of the rune */
+        constexpr const char *base() const noexcept { return p_; }
+
+        constexpr int32_t operator*() const noexcept
+        {
+            int32_t rune = replacement;
+            if (static_cast<unsigned char>(*p_) < 0x80) return *p_;
+            decode(&rune, p_, static_cast<std::size_t>(last_ - p_));
+            return rune;
+        }
+
+        constexpr iterator &operator++() noexcept
+        {
+            std::size_t size = 1;
+            if (static_cast<unsigned char>(*p_) >= 0x80)
+                size = sequence_size(p_, static_cast<std::size_t>(last_ - p_));
+            p_ += size;
+            return *this;
+        }
+
+        constexpr iterator operator++(int) noexcept
+        {
+            iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        constexpr iterator &operator--() noexcept
+        {
+            std::size_t k = 1, room = static_cast<std::size_t>(p_ - first_);
+            if ((static_cast<unsigned char>(p_[-1]) & 0xc0) == 0x80) {
+                /* 
+                The lead byte is at most 3 continuation bytes before. It 
+                starts the rune if its sequence, or its maximal subpart, 
+                ends here; else the continuation byte is a rune alone.
+                */
+                k = 2;
+                while (k <= 4 && k <= room && 
+                    (static_cast<unsigned char>(p_[-k]) & 0xc0) == 0x80) k++;
+                if (k > 4 || k > room || sequence_size(p_ - k, 
+                    static_cast<std::size_t>(last_ - p_) + k) != k) k = 1;
+            }
+            p_ -= k;
+            return *this;
+        }
+
+        constexpr iterator operator--(int) noexcept
+        {
+            iterator previous = *this;
+            --*this;
+            return previous;
+        }
+
+        friend constexpr bool operator==(const iterator &a,
+            const iterator &b) noexcept
+        {
+            return a.p_ == b.p_;
+        }
+
+        friend constexpr bool operator!=(const iterator &a,
+            const iterator &b) noexcept
+        {
+            return a.p_ != b.p_;
+        }
+
+    private:
+        const char *first_ = nullptr;
+        const char *p_ = nullptr;
+        const char *last_ = nullptr;
+    };
+
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+
+    constexpr rune_view() noexcept = default;
+    constexpr rune_view(std::string_view bytes) noexcept : bytes_(bytes) {}
+
+    constexpr iterator begin() const noexcept
+    {
+        return iterator(first(), first(), last());
+    }
+    constexpr iterator end() const noexcept
+    {
+        return iterator(first(), last(), last());
+    }
+    constexpr reverse_iterator rbegin() const noexcept
+    {
+        return reverse_iterator(end());
+    }
+    constexpr reverse_iterator rend() const noexcept
+    {
+        return reverse_iterator(begin());
+    }
+
+    constexpr bool empty() const noexcept { return bytes_.empty(); }
+    /* the bytes viewed */
+    constexpr std::string_view bytes() const noexcept { return bytes_; }
+
+    /* the number of runes, reading through the bytes */
+    constexpr std::size_t size() const noexcept
+    {
+        std::size_t n = 0;
+        for (iterator i = begin(), e = end(); i != e; ++i) n++;
+        return n;
+    }
+
+    /*
+    the bytes of the runes between `a` and `b`, iterators of this view
+    */
+    constexpr std::string_view bytes(iterator a, iterator b) const noexcept
+    {
+        return bytes_.substr(static_cast<std::size_t>(a.base() - first()),
+            static_cast<std::size_t>(b.base() - a.base()));
+    }
+
+private:
+    constexpr const char *first() const noexcept { return bytes_.data(); }
+    constexpr const char *last() const noexcept
+    {
+        return bytes_.data() + bytes_.size();
+    }
+
+    std::string_view bytes_;
+};
+
+/*
+`runes` returns a `rune_view` of `s`.
+*/
+constexpr rune_view runes(std::string_view s) noexcept
+{
+    return rune_view(s);
+}
+
+}
+
+#if __cplusplus >= 202002L
+/* the iterators point into the viewed bytes, not into the view */
+template <>
+inline constexpr bool std::ranges::enable_borrowed_range<utf8::rune_view> =
+    true;
+template <>
+inline constexpr bool std::ranges::enable_view<utf8::rune_view> = true;
+#endif
+
+#endif
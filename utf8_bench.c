@@ -0,0 +1,690 @@
+#define _POSIX_C_SOURCE 200809L /* locale_t, newlocale and clock_gettime */
+
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define read_cycles() __rdtsc()
+#else
+#define read_cycles() 0 /* cycles/byte is reported as 0 */
+#endif
+
+#include "utf8.h"
+
+/*
+Measures the throughput of the functions of the library on synthetic
+corpora (ASCII, Latin-1 accents, Cyrillic, CJK, emoji, a mix of them and
+the mix with invalid bytes) and on the files given as arguments. Each
+function runs once to warm up, then `-n` times; the best and the median
+times are reported with the UTF-8 bytes per second, the runes per second
+and the timestamp counter cycles per byte (reference cycles, not core
+cycles), as CSV or JSON lines on the standard output:
+
+    utf8_bench [-n repetitions] [-s size] [-f csv|json] [-b function]
+               [-c corpus] [file...]
+
+`-s` sets the size of the synthetic corpora (1 MiB by default), `-b` and
+`-c` select the functions and the corpora whose names contain the given
+text. The rates are per byte of the UTF-8 corpus whatever the direction of
+the conversion, so the functions can be compared. The functions which
+don't accept invalid UTF-8 are skipped on the invalid corpora, and the
+locale functions (in the locale of the environment) on the corpora the
+locale can't encode. The zero-terminated functions run on the corpora 
+holding no 0 byte.
+Build: cc -O2 utf8_bench.c utf8.c -o utf8_bench -lpthread
+*/
+
+#define MAX_REPS 1000
+#define FAILED ((size_t)-1)
+
+enum { NEEDS_VALID = 1, NEEDS_LOCAL = 2, NEEDS_STRING = 4 };
+
+struct corpus {
+    const char *name;
+    char *text; /* the UTF-8 bytes, maybe invalid, followed by a 0 */
+    size_t size;
+    int valid;
+    int string; /* `text` holds no 0 byte, so it's a string of `size` */
+    int32_t *runes; /* the runes of `text`, with U+FFFD for the errors */
+    size_t n_runes;
+    wchar_t *wide; /* followed by a 0, like the other forms */
+    size_t n_wide;
+    uint16_t *utf16; /* `text` in UTF-16, with U+FFFD for the errors */
+    size_t n_utf16;
+    char *latin1; /* `text` in Latin-1, with '?' for the other runes */
+    size_t n_latin1;
+    char *local; /* `text` in the locale encoding, NULL if not encodable */
+    size_t n_local;
+    char *escaped; /* `text` with `\u` escapes */
+    size_t n_escaped;
+    FILE *file; /* a temporary file holding `text` */
+};
+
+struct bench {
+    const char *name;
+    int needs;
+    size_t (*run)(const struct corpus *c); /* returns FAILED on error */
+};
+
+static char *out;
+static wchar_t *wide_out;
+static uint16_t *utf16_out;
+static int32_t *runes_out;
+static FILE *scratch;
+static utf8_local_conv *conv;
+static locale_t locale;
+static utf8_arena *arena;
+static volatile size_t sink; /* keeps the results alive */
+
+static size_t run_decode(const struct corpus *c)
+{
+    int32_t rune, sum = 0;
+    size_t used = 0, n = 0, size;
+    while (used < c->size) {
+        size = utf8_decode(&rune, c->text + used, c->size - used);
+        if (size == 0) return FAILED;
+        sum ^= rune;
+        used += size;
+        n++;
+    }
+    sink = (size_t)sum;
+    return n;
+}
+
+static size_t run_decoder_feed(const struct corpus *c)
+{
+    utf8_decoder decoder;
+    size_t used = 0, done = 0, got, parsed, chunk;
+    utf8_decoder_init(&decoder);
+    while (used < c->size) { /* like the chunks received from a socket */
+        chunk = c->size - used < 1500 ? c->size - used : 1500;
+        got = utf8_decoder_feed(&decoder, c->text + used, chunk,
+            runes_out + done, c->size, &parsed);
+        if (got == FAILED) return FAILED;
+        used += parsed;
+        done += got;
+    }
+    return done;
+}
+
+static size_t run_get_rune(const struct corpus *c)
+{
+    size_t n = 0;
+    rewind(c->file);
+    while (utf8_get_rune(c->file) != -1) n++;
+    return n;
+}
+
+static size_t run_put_rune(const struct corpus *c)
+{
+    size_t i;
+    rewind(scratch);
+    for (i = 0; i < c->n_runes; i++) {
+        if (utf8_put_rune(c->runes[i], scratch) == -1) return FAILED;
+    }
+    fflush(scratch);
+    return c->n_runes;
+}
+
+static size_t run_reader_next(const struct corpus *c)
+{
+    utf8_reader *reader;
+    size_t n = 0;
+    rewind(c->file);
+    reader = utf8_reader_open(c->file);
+    if (reader == NULL) return FAILED;
+    while (utf8_reader_next(reader) != -1) n++;
+    utf8_reader_close(reader);
+    return n;
+}
+
+static size_t run_reader(const struct corpus *c)
+{
+    utf8_reader *reader;
+    size_t n = 0, got;
+    rewind(c->file);
+    reader = utf8_reader_open(c->file);
+    if (reader == NULL) return FAILED;
+    while ((got = utf8_reader_read_runes(reader, runes_out, 4096)) > 0)
+        n += got;
+    utf8_reader_close(reader);
+    return n;
+}
+
+static size_t run_writer(const struct corpus *c)
+{
+    utf8_writer *writer;
+    size_t n;
+    rewind(scratch);
+    writer = utf8_writer_open(scratch);
+    if (writer == NULL) return FAILED;
+    n = utf8_writer_put_runes(writer, c->runes, c->n_runes);
+    if (utf8_writer_close(writer) != 0) return FAILED;
+    fflush(scratch);
+    return n;
+}
+
+static size_t run_writer_put_rune(const struct corpus *c)
+{
+    utf8_writer *writer;
+    size_t i;
+    rewind(scratch);
+    writer = utf8_writer_open(scratch);
+    if (writer == NULL) return FAILED;
+    for (i = 0; i < c->n_runes; i++) {
+        if (utf8_writer_put_rune(writer, c->runes[i]) == -1) break;
+    }
+    if (utf8_writer_close(writer) != 0 || i < c->n_runes) return FAILED;
+    fflush(scratch);
+    return c->n_runes;
+}
+
+static size_t run_encode(const struct corpus *c)
+{
+    size_t i, n = 0;
+    for (i = 0; i < c->n_runes; i++) n += utf8_encode(out + n, c->runes[i]);
+    return n;
+}
+
+static size_t run_encode_runes(const struct corpus *c)
+{
+    return utf8_encode_runes(out, c->runes, c->n_runes);
+}
+
+static size_t run_decode_runes(const struct corpus *c)
+{
+    return utf8_decode_runes(runes_out, c->text, c->size, NULL);
+}
+
+static size_t run_validate(const struct corpus *c)
+{
+    return utf8_validate(c->text, c->size);
+}
+
+static size_t run_count_runes(const struct corpus *c)
+{
+    return utf8_count_runes(c->text, c->size);
+}
+
+static size_t run_wchars_needed(const struct corpus *c)
+{
+    return utf8_wchars_needed(c->text, c->size);
+}
+
+static size_t run_bytes_needed(const struct corpus *c)
+{
+    return utf8_bytes_needed_for_wchars(c->wide, c->n_wide);
+}
+
+static size_t run_index(const struct corpus *c)
+{
+    utf8_index *index = utf8_index_open(64, 0);
+    size_t n;
+    if (index == NULL || utf8_index_extend(index, c->text, c->size) != 0) {
+        utf8_index_close(index);
+        return FAILED;
+    }
+    n = utf8_index_runes(index);
+    utf8_index_close(index);
+    return n;
+}
+
+static size_t run_to_wchars(const struct corpus *c)
+{
+    return utf8_to_wchars_n(wide_out, c->text, c->size, c->size, NULL);
+}
+
+static size_t run_to_wchars_z(const struct corpus *c)
+{
+    return utf8_to_wchars(wide_out, c->text, c->size + 1);
+}
+
+static size_t run_to_wchars_parallel(const struct corpus *c)
+{
+    return utf8_to_wchars_parallel(wide_out, c->text, c->size, c->size,
+        NULL, 4);
+}
+
+static size_t run_to_wchars_lossy(const struct corpus *c)
+{
+    return utf8_to_wchars_lossy(wide_out, c->text, c->size, c->size, NULL,
+        NULL);
+}
+
+static size_t run_to_wchars_alloc(const struct corpus *c)
+{
+    utf8_allocator allocator = utf8_arena_allocator(arena);
+    size_t n = FAILED;
+    if (utf8_to_wchars_alloc(&allocator, c->text, c->size, &n) == NULL)
+        n = FAILED;
+    utf8_arena_reset(arena);
+    return n;
+}
+
+static size_t run_of_wchars(const struct corpus *c)
+{
+    return utf8_of_wchars_n(out, c->wide, c->n_wide, c->size * 4, NULL);
+}
+
+static size_t run_of_wchars_z(const struct corpus *c)
+{
+    return utf8_of_wchars(out, c->wide, c->size * 4 + 1);
+}
+
+static size_t run_of_wchars_alloc(const struct corpus *c)
+{
+    utf8_allocator allocator = utf8_arena_allocator(arena);
+    size_t n = FAILED;
+    if (utf8_of_wchars_alloc(&allocator, c->wide, c->n_wide, &n) == NULL)
+        n = FAILED;
+    utf8_arena_reset(arena);
+    return n;
+}
+
+static size_t run_to_utf16(const struct corpus *c)
+{
+    return utf8_to_utf16(utf16_out, c->text, c->size, c->size * 2, NULL);
+}
+
+static size_t run_of_utf16(const struct corpus *c)
+{
+    return utf8_of_utf16(out, c->utf16, c->n_utf16, c->size * 4, NULL);
+}
+
+static size_t run_to_latin1(const struct corpus *c)
+{
+    return utf8_to_latin1(out, c->text, c->size, c->size, NULL, '?');
+}
+
+static size_t run_of_latin1(const struct corpus *c)
+{
+    return utf8_of_latin1(out, c->latin1, c->n_latin1, c->size * 4, NULL);
+}
+
+static size_t run_repair(const struct corpus *c)
+{
+    return utf8_repair(out, c->text, c->size, c->size * 4, NULL, NULL);
+}
+
+static size_t run_to_local(const struct corpus *c)
+{
+    return utf8_to_local_n(out, c->text, c->size, c->size * 4, NULL);
+}
+
+static size_t run_of_local(const struct corpus *c)
+{
+    return utf8_of_local_n(out, c->local, c->n_local, c->size * 4, NULL);
+}
+
+static size_t run_to_local_z(const struct corpus *c)
+{
+    return utf8_to_local(out, c->text, c->size * 4 + 1);
+}
+
+static size_t run_of_local_z(const struct corpus *c)
+{
+    return utf8_of_local(out, c->local, c->size * 4 + 1);
+}
+
+static size_t run_to_local_l(const struct corpus *c)
+{
+    return utf8_to_local_l(locale, out, c->text, c->size, c->size * 4, 
+        NULL);
+}
+
+static size_t run_of_local_l(const struct corpus *c)
+{
+    return utf8_of_local_l(locale, out, c->local, c->n_local, c->size * 4,
+        NULL);
+}
+
+static size_t run_to_local_conv(const struct corpus *c)
+{
+    return utf8_to_local_conv(conv, out, c->text, c->size, c->size * 4,
+        NULL);
+}
+
+static size_t run_of_local_conv(const struct corpus *c)
+{
+    return utf8_of_local_conv(conv, out, c->local, c->n_local, c->size * 4,
+        NULL);
+}
+
+static size_t run_to_ascii(const struct corpus *c)
+{
+    return utf8_to_ascii_n(out, c->text, c->size, c->size * 4, NULL);
+}
+
+static size_t run_of_ascii(const struct corpus *c)
+{
+    return utf8_of_ascii_n(out, c->escaped, c->n_escaped, c->size * 4,
+        NULL);
+}
+
+static size_t run_to_ascii_z(const struct corpus *c)
+{
+    return utf8_to_ascii(out, c->text, c->size * 4 + 1);
+}
+
+static size_t run_of_ascii_z(const struct corpus *c)
+{
+    return utf8_of_ascii(out, c->escaped, c->size * 4 + 1);
+}
+
+static const struct bench benches[] = {
+    {"utf8_decode", NEEDS_VALID, run_decode},
+    {"utf8_decoder_feed", NEEDS_VALID, run_decoder_feed},
+    {"utf8_get_rune", 0, run_get_rune},
+    {"utf8_put_rune", 0, run_put_rune},
+    {"utf8_reader_next", 0, run_reader_next},
+    {"utf8_reader_read_runes", 0, run_reader},
+    {"utf8_writer_put_rune", 0, run_writer_put_rune},
+    {"utf8_writer_put_runes", 0, run_writer},
+    {"utf8_encode", 0, run_encode},
+    {"utf8_encode_runes", 0, run_encode_runes},
+    {"utf8_decode_runes", NEEDS_VALID, run_decode_runes},
+    {"utf8_validate", 0, run_validate},
+    {"utf8_count_runes", NEEDS_VALID, run_count_runes},
+    {"utf8_wchars_needed", NEEDS_VALID, run_wchars_needed},
+    {"utf8_bytes_needed_for_wchars", 0, run_bytes_needed},
+    {"utf8_index_extend", NEEDS_VALID, run_index},
+    {"utf8_to_wchars", NEEDS_VALID | NEEDS_STRING, run_to_wchars_z},
+    {"utf8_to_wchars_n", NEEDS_VALID, run_to_wchars},
+    {"utf8_to_wchars_parallel", NEEDS_VALID, run_to_wchars_parallel},
+    {"utf8_to_wchars_lossy", 0, run_to_wchars_lossy},
+    {"utf8_to_wchars_alloc", NEEDS_VALID, run_to_wchars_alloc},
+    {"utf8_of_wchars", NEEDS_STRING, run_of_wchars_z},
+    {"utf8_of_wchars_n", 0, run_of_wchars},
+    {"utf8_of_wchars_alloc", 0, run_of_wchars_alloc},
+    {"utf8_to_utf16", NEEDS_VALID, run_to_utf16},
+    {"utf8_of_utf16", 0, run_of_utf16},
+    {"utf8_to_latin1", NEEDS_VALID, run_to_latin1},
+    {"utf8_of_latin1", NEEDS_VALID, run_of_latin1},
+    {"utf8_repair", 0, run_repair},
+    {"utf8_to_local", NEEDS_VALID | NEEDS_LOCAL | NEEDS_STRING, 
+        run_to_local_z},
+    {"utf8_of_local", NEEDS_LOCAL | NEEDS_STRING, run_of_local_z},
+    {"utf8_to_local_n", NEEDS_VALID | NEEDS_LOCAL, run_to_local},
+    {"utf8_of_local_n", NEEDS_LOCAL, run_of_local},
+    {"utf8_to_local_l", NEEDS_VALID | NEEDS_LOCAL, run_to_local_l},
+    {"utf8_of_local_l", NEEDS_LOCAL, run_of_local_l},
+    {"utf8_to_local_conv", NEEDS_VALID | NEEDS_LOCAL, run_to_local_conv},
+    {"utf8_of_local_conv", NEEDS_LOCAL, run_of_local_conv},
+    {"utf8_to_ascii", NEEDS_VALID | NEEDS_STRING, run_to_ascii_z},
+    {"utf8_of_ascii", NEEDS_STRING, run_of_ascii_z},
+    {"utf8_to_ascii_n", NEEDS_VALID, run_to_ascii},
+    {"utf8_of_ascii_n", 0, run_of_ascii}
+};
+
+/* The words of the synthetic corpora, in UTF-8. */
+static const char *ascii_words[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog. ",
+    "Lorem ", "ipsum ", "dolor ", "sit ", "amet,\n", "{\"key\": 42}, "
+};
+static const char *latin1_words[] = {
+    "d\xc3\xa9j\xc3\xa0 ", "vu ", "\xc3\xbc" "ber ", "Stra\xc3\x9f" "e ",
+    "ni\xc3\xb1o ", "a\xc3\xa7\xc3\xa3o ", "gar\xc3\xa7on ", "caf\xc3\xa9 ",
+    "fa\xc3\xa7" "ade ", "M\xc3\xbcller ", "\xc2\xa3" "10 ", "le ", "la "
+};
+static const char *cyrillic_words[] = {
+    "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 ",
+    "\xd0\xbc\xd0\xb8\xd1\x80 ", "\xd0\xb8 ", "\xd0\xb2\xd0\xbe\xd0\xb9"
+    "\xd0\xbd\xd0\xb0 ", "\xd1\x81\xd0\xbb\xd0\xbe\xd0\xb2\xd0\xbe, ",
+    "\xd0\x9c\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0.\n"
+};
+static const char *cjk_words[] = {
+    "\xe4\xb8\xad\xe6\x96\x87", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+    "\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4", "\xe3\x80\x82",
+    "\xe6\xbc\xa2\xe5\xad\x97", "\xe3\x81\xb2\xe3\x82\x89\xe3\x81\x8c"
+    "\xe3\x81\xaa", "\xef\xbc\x8c"
+};
+static const char *emoji_words[] = {
+    "\xf0\x9f\x98\x80", "\xf0\x9f\x91\x8d", "\xf0\x9f\x8e\x89 ",
+    "\xf0\x9f\x9a\x80", "\xf0\x9f\x8c\x8d", "\xf0\x9f\x94\xa5"
+};
+static const char *invalid_words[] = {
+    "\xff", "\x80", "\xc3", "\xe4\xb8", "\xed\xa0\x80", "\xc0\xaf"
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static struct {
+    const char **words;
+    size_t n_words;
+} scripts[] = {
+    {ascii_words, COUNT(ascii_words)},
+    {latin1_words, COUNT(latin1_words)},
+    {cyrillic_words, COUNT(cyrillic_words)},
+    {cjk_words, COUNT(cjk_words)},
+    {emoji_words, COUNT(emoji_words)}
+};
+
+static const char *synthetic_names[] = {
+    "ascii", "latin1", "cyrillic", "cjk", "emoji", "mixed", "invalid"
+};
+
+static unsigned long seed = 1;
+
+static size_t next_random(size_t n)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return (size_t)((seed >> 16) % n);
+}
+
+/* Fills `text` with `size` bytes at most of words of the kind `kind`. */
+static size_t make_text(char *text, size_t size, int kind)
+{
+    const char *word;
+    size_t n = 0, length, script;
+    while (1) {
+        script = kind < 5 ? (size_t)kind : next_random(5);
+        word = scripts[script].words[next_random(scripts[script].n_words)];
+        if (kind == 6 && next_random(64) == 0)
+            word = invalid_words[next_random(COUNT(invalid_words))];
+        length = strlen(word);
+        if (n + length > size) break;
+        memcpy(text + n, word, length);
+        n += length;
+    }
+    return n;
+}
+
+/* Makes the forms of the text of `c` read by the functions. */
+static int prepare(struct corpus *c)
+{
+    utf8_reader *reader;
+    char *repaired;
+    size_t n;
+    c->valid = utf8_validate(c->text, c->size) == c->size;
+    c->string = strlen(c->text) == c->size;
+    c->runes = malloc((c->size + 1) * sizeof(int32_t));
+    c->wide = malloc((c->size + 1) * sizeof(wchar_t));
+    c->file = tmpfile();
+    if (c->runes == NULL || c->wide == NULL || c->file == NULL) return -1;
+    if (fwrite(c->text, 1, c->size, c->file) != c->size) return -1;
+    fflush(c->file);
+    rewind(c->file);
+    reader = utf8_reader_open(c->file);
+    if (reader == NULL) return -1;
+    c->n_runes = utf8_reader_read_runes(reader, c->runes, c->size);
+    utf8_reader_close(reader);
+    c->n_wide = utf8_to_wchars_lossy(c->wide, c->text, c->size, c->size,
+        NULL, NULL);
+    c->wide[c->n_wide] = 0;
+    c->utf16 = malloc((c->size + 1) * sizeof(uint16_t));
+    repaired = malloc(c->size * 3 + 1);
+    if (c->utf16 == NULL || repaired == NULL) return -1;
+    n = utf8_repair(repaired, c->text, c->size, c->size * 3, NULL, NULL);
+    c->n_utf16 = utf8_to_utf16(c->utf16, repaired, n, c->size, NULL);
+    free(repaired);
+    if (c->valid && (c->latin1 = malloc(c->size + 1)) != NULL)
+        c->n_latin1 = utf8_to_latin1(c->latin1, c->text, c->size, c->size,
+            NULL, '?');
+    n = utf8_to_ascii_n(NULL, c->text, c->size, 0, NULL);
+    if (c->valid && n != FAILED && (c->escaped = malloc(n + 1)) != NULL) {
+        c->n_escaped = utf8_to_ascii_n(c->escaped, c->text, c->size, n,
+            NULL);
+        c->escaped[c->n_escaped] = 0;
+    }
+    n = utf8_to_local_n(NULL, c->text, c->size, 0, NULL);
+    if (c->valid && n != FAILED && (c->local = malloc(n + 1)) != NULL) {
+        c->n_local = utf8_to_local_n(c->local, c->text, c->size, n, NULL);
+        c->local[c->n_local] = 0;
+    }
+    return 0;
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int json;
+
+static void report(const struct corpus *c, const struct bench *b,
+    int n_reps, double best, double median, double cycles)
+{
+    double bytes = (double)c->size;
+    if (json) {
+        printf("{\"corpus\": \"%s\", \"function\": \"%s\", \"bytes\": %zu, "
+            "\"runes\": %zu, \"reps\": %d, \"best_ns\": %.0f, "
+            "\"median_ns\": %.0f, \"gb_per_s\": %.3f, "
+            "\"mrunes_per_s\": %.1f, \"cycles_per_byte\": %.3f}\n",
+            c->name, b->name, c->size, c->n_runes, n_reps, best * 1e9,
+            median * 1e9, bytes / best / 1e9, c->n_runes / best / 1e6,
+            cycles / bytes);
+    } else {
+        printf("%s,%s,%zu,%zu,%d,%.0f,%.0f,%.3f,%.1f,%.3f\n", c->name,
+            b->name, c->size, c->n_runes, n_reps, best * 1e9, median * 1e9,
+            bytes / best / 1e9, c->n_runes / best / 1e6, cycles / bytes);
+    }
+    fflush(stdout);
+}
+
+static void measure(const struct corpus *c, const struct bench *b,
+    int n_reps)
+{
+    static double times[MAX_REPS];
+    double start, cycles = 0;
+    uint64_t start_cycles, best_cycles = 0;
+    int i;
+    if ((b->needs & NEEDS_VALID) != 0 && !c->valid) return;
+    if ((b->needs & NEEDS_LOCAL) != 0 && c->local == NULL) return;
+    if ((b->needs & NEEDS_STRING) != 0 && !c->string) return;
+    if (b->run(c) == FAILED) { /* the warmup */
+        fprintf(stderr, "%s failed on %s: %s\n", b->name, c->name,
+            strerror(errno));
+        return;
+    }
+    for (i = 0; i < n_reps; i++) {
+        start = now();
+        start_cycles = read_cycles();
+        sink = b->run(c);
+        start_cycles = read_cycles() - start_cycles;
+        times[i] = now() - start;
+        if (i == 0 || start_cycles < best_cycles) best_cycles = start_cycles;
+    }
+    cycles = (double)best_cycles;
+    qsort(times, (size_t)n_reps, sizeof(double), compare_times);
+    report(c, b, n_reps, times[0], times[n_reps / 2], cycles);
+}
+
+static int read_file(const char *name, struct corpus *c)
+{
+    FILE *file = fopen(name, "rb");
+    long size;
+    if (file == NULL || fseek(file, 0, SEEK_END) != 0 ||
+        (size = ftell(file)) < 0) {
+        if (file != NULL) fclose(file);
+        return -1;
+    }
+    rewind(file);
+    c->name = name;
+    c->text = malloc((size_t)size + 1);
+    c->size = c->text == NULL ? 0 : fread(c->text, 1, (size_t)size, file);
+    if (c->text != NULL) c->text[c->size] = 0;
+    fclose(file);
+    return c->text == NULL ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static struct corpus corpora[64];
+    const char *bench_filter = "", *corpus_filter = "";
+    size_t size = 1 << 20, max_size = 0, i, j;
+    int n_reps = 10, n_corpora = 0, arg = 1;
+    setlocale(LC_ALL, "");
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-n") == 0) n_reps = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-s") == 0)
+            size = (size_t)strtoul(argv[arg + 1], NULL, 10);
+        else if (strcmp(argv[arg], "-f") == 0)
+            json = strcmp(argv[arg + 1], "json") == 0;
+        else if (strcmp(argv[arg], "-b") == 0) bench_filter = argv[arg + 1];
+        else if (strcmp(argv[arg], "-c") == 0) corpus_filter = argv[arg + 1];
+        else break;
+    }
+    if (n_reps < 1 || n_reps > MAX_REPS || size == 0) {
+        fprintf(stderr, "Usage: utf8_bench [-n repetitions] [-s size] "
+            "[-f csv|json] [-b function] [-c corpus] [file...]\n");
+        return 2;
+    }
+    for (i = 0; i < COUNT(synthetic_names); i++) {
+        corpora[n_corpora].name = synthetic_names[i];
+        corpora[n_corpora].text = malloc(size + 1);
+        if (corpora[n_corpora].text == NULL) return 1;
+        corpora[n_corpora].size = make_text(corpora[n_corpora].text, size,
+            (int)i);
+        corpora[n_corpora].text[corpora[n_corpora].size] = 0;
+        n_corpora++;
+    }
+    for (; arg < argc && n_corpora < 64; arg++) {
+        if (read_file(argv[arg], corpora + n_corpora) != 0) {
+            fprintf(stderr, "Can't read \"%s\".\n", argv[arg]);
+            return 1;
+        }
+        n_corpora++;
+    }
+    for (i = 0; i < (size_t)n_corpora; i++) {
+        if (prepare(corpora + i) != 0) return 1;
+        if (corpora[i].size > max_size) max_size = corpora[i].size;
+    }
+    out = malloc(max_size * 4 + 64);
+    wide_out = malloc((max_size + 64) * sizeof(wchar_t));
+    utf16_out = malloc((max_size * 2 + 64) * sizeof(uint16_t));
+    runes_out = malloc((max_size + 4096) * sizeof(int32_t));
+    scratch = tmpfile();
+    conv = utf8_local_conv_open(NULL);
+    locale = newlocale(LC_CTYPE_MASK, "", (locale_t)0);
+    arena = utf8_arena_open(0);
+    if (out == NULL || wide_out == NULL || utf16_out == NULL || 
+        runes_out == NULL || scratch == NULL || arena == NULL) return 1;
+    if (!json) {
+        printf("corpus,function,bytes,runes,reps,best_ns,median_ns,"
+            "gb_per_s,mrunes_per_s,cycles_per_byte\n");
+    }
+    for (i = 0; i < (size_t)n_corpora; i++) {
+        if (strstr(corpora[i].name, corpus_filter) == NULL) continue;
+        for (j = 0; j < COUNT(benches); j++) {
+            if (strstr(benches[j].name, bench_filter) == NULL) continue;
+            if ((benches[j].needs & NEEDS_LOCAL) != 0 && 
+                (conv == NULL || locale == (locale_t)0)) continue;
+            measure(corpora + i, benches + j, n_reps);
+        }
+    }
+    return 0;
+}
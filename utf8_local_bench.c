@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L /* locale_t, newlocale and clock_gettime */
+
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf8.h"
+
+/*
+Converts a UTF-8 text to the encoding of a locale and back with 1, 2, 4...
+threads at once, with the functions using the global locale (`_n`), an
+explicit `locale_t` (`_l`) and a shared converter (`conv`), and prints the
+throughput of all the threads together. The throughput of the `_l` and
+`conv` functions should grow with the number of threads up to the number
+of processors.
+Usage: utf8_local_bench [locale [maximum number of threads]]
+*/
+
+#define TEXT_SIZE (1 << 20)
+#define ROUNDS 20
+#define MAX_THREADS 256
+
+enum { USE_N, USE_L, USE_CONV };
+
+static const char *mode_names[] = {"_n", "_l", "conv"};
+
+static char text[TEXT_SIZE];
+static size_t text_size;
+static locale_t locale;
+static utf8_local_conv *conv;
+
+struct job {
+    int mode;
+    pthread_t thread;
+    size_t done; /* the number of UTF-8 bytes converted both ways */
+    int failed;
+};
+
+static void make_text(void)
+{
+    /* words encodable in the common single-byte and multibyte locales */
+    static const char *words[] = {
+        "the ", "quick ", "brown ", "fox ", "jumps\n", "over ", "lazy ",
+        "d\xc3\xa9j\xc3\xa0 ", "vu ", "\xc3\xbc" "ber ", "ni\xc3\xb1o ",
+        "a\xc3\xa7\xc3\xa3o ", "12,5 ", "\xc2\xa3" "10 ", "caf\xc3\xa9\n"
+    };
+    size_t i = 0, size;
+    while (1) {
+        size = strlen(words[i % 15]);
+        if (text_size + size > TEXT_SIZE) break;
+        memcpy(text + text_size, words[i % 15], size);
+        text_size += size;
+        i = i * 7 + 3;
+    }
+}
+
+static size_t to_local(int mode, char *buffer, size_t count)
+{
+    if (mode == USE_N)
+        return utf8_to_local_n(buffer, text, text_size, count, NULL);
+    if (mode == USE_L)
+        return utf8_to_local_l(locale, buffer, text, text_size, count, NULL);
+    return utf8_to_local_conv(conv, buffer, text, text_size, count, NULL);
+}
+
+static size_t of_local(int mode, char *buffer, const char *s, size_t n_bytes)
+{
+    if (mode == USE_N)
+        return utf8_of_local_n(buffer, s, n_bytes, TEXT_SIZE, NULL);
+    if (mode == USE_L)
+        return utf8_of_local_l(locale, buffer, s, n_bytes, TEXT_SIZE, NULL);
+    return utf8_of_local_conv(conv, buffer, s, n_bytes, TEXT_SIZE, NULL);
+}
+
+static void *run_job(void *arg)
+{
+    struct job *job = arg;
+    size_t i = 0, n_local, n_back;
+    /* the multibyte encodings may take more bytes than UTF-8 */
+    char *local = malloc(TEXT_SIZE * 2), *back = malloc(TEXT_SIZE);
+    while (local != NULL && back != NULL && i < ROUNDS) {
+        n_local = to_local(job->mode, local, TEXT_SIZE * 2);
+        if (n_local == (size_t)-1) break;
+        n_back = of_local(job->mode, back, local, n_local);
+        if (n_back != text_size || memcmp(back, text, text_size) != 0) break;
+        job->done += text_size;
+        i++;
+    }
+    job->failed = i < ROUNDS;
+    free(local);
+    free(back);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int run(int mode, int n_threads, double *speed)
+{
+    static struct job jobs[MAX_THREADS];
+    size_t done = 0;
+    double start;
+    int i, failed = 0;
+    start = now();
+    for (i = 0; i < n_threads; i++) {
+        jobs[i].mode = mode;
+        jobs[i].done = 0;
+        jobs[i].failed = 0;
+        if (pthread_create(&jobs[i].thread, NULL, run_job, jobs + i) != 0)
+            break;
+    }
+    n_threads = i;
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(jobs[i].thread, NULL);
+        done += jobs[i].done;
+        failed |= jobs[i].failed;
+    }
+    *speed = done / (now() - start) / 1e6;
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = argc > 1 ? argv[1] : "";
+    int mode, n_threads, max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    double speed, first;
+    if (max_threads < 1 || max_threads > MAX_THREADS) max_threads = 8;
+    if (setlocale(LC_CTYPE, name) == NULL) {
+        fprintf(stderr, "Can't set the locale \"%s\".\n", name);
+        return 1;
+    }
+    locale = newlocale(LC_CTYPE_MASK, name, (locale_t)0);
+    conv = utf8_local_conv_open(name);
+    if (locale == (locale_t)0 || conv == NULL) {
+        fprintf(stderr, "Can't open the locale \"%s\".\n", name);
+        return 1;
+    }
+    make_text();
+    printf("locale \"%s\", %zu bytes converted %d times per thread\n",
+        setlocale(LC_CTYPE, NULL), text_size, ROUNDS);
+    printf("%-6s %8s %12s %8s\n", "mode", "threads", "MB/s", "scaling");
+    for (mode = USE_N; mode <= USE_CONV; mode++) {
+        first = 0;
+        for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+            if (run(mode, n_threads, &speed) != 0) {
+                printf("%-6s %8d %12s\n", mode_names[mode], n_threads,
+                    "failed");
+                break;
+            }
+            if (first == 0) first = speed;
+            printf("%-6s %8d %12.1f %8.2f\n", mode_names[mode], n_threads,
+                speed, speed / first);
+        }
+    }
+    utf8_local_conv_close(conv);
+    freelocale(locale);
+    return 0;
+}
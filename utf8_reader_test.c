@@ -0,0 +1,49 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "utf8.h"
+
+static int count_runes(FILE *input, const char *name)
+{
+    int32_t runes[4096];
+    size_t i, n, n_runes = 0, n_lines = 0, n_invalid = 0;
+    utf8_reader *reader = utf8_reader_open(input);
+    if (reader == NULL) {
+        fprintf(stderr, "Can't create a reader for \"%s\".\n", name);
+        return -1;
+    }
+    while ((n = utf8_reader_read_runes(reader, runes, 4096)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (runes[i] == '\n') n_lines++;
+            if (runes[i] == 0xfffd) n_invalid++;
+        }
+        n_runes += n;
+    }
+    if (utf8_reader_error(reader) != 0)
+        fprintf(stderr, "Reading \"%s\" failed.\n", name);
+    printf("%s: %zu rune(s), %zu line(s), %zu replacement character(s)\n",
+        name, n_runes, n_lines, n_invalid);
+    utf8_reader_close(reader);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i = 1;
+    FILE *input;
+    if (argc < 2) return count_runes(stdin, "<stdin>") != 0;
+    while (i < argc) {
+        input = fopen(argv[i], "rb");
+        if (input == NULL) {
+            fprintf(stderr, "Can't open \"%s\".\n", argv[i]);
+            break;
+        }
+        count_runes(input, argv[i]);
+        fclose(input);
+        i++;
+    }
+    if (i < argc) 
+        printf("There are %d arguments left.\n", argc - i);
+    return argc - i;
+}
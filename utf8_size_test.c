@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+
+/*
+Converts generated strings into buffers sized by the NULL-buffer query of
+the same function, as the documentation tells to do. Built with
+-fsanitize=address, a write past the result is reported as an overflow.
+Returns the number of failed checks.
+*/
+
+static const char *pieces[] = {
+    "a", "z~", "\xc3\xa9", "\xd0\x96", "\xe4\xbd\xa0", "\xe2\x82\xac",
+    "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf"
+};
+
+static uint32_t seed = 1;
+
+static unsigned next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/* builds at `s` a string of `n_pieces` pieces drawn from the first `n` */
+static size_t make_string(char *s, size_t n_pieces, unsigned n)
+{
+    size_t i, size = 0;
+    const char *piece;
+    for (i = 0; i < n_pieces; i++) {
+        piece = pieces[i == 0 ? 0 : next_random() % n];
+        memcpy(s + size, piece, strlen(piece));
+        size += strlen(piece);
+    }
+    s[size] = 0;
+    return size;
+}
+
+static int check(const char *name, const char *s, size_t expected,
+    size_t result)
+{
+    if (result == expected) return 0;
+    printf("%s: \"%s\" gave %zu instead of %zu.\n", name, s, result,
+        expected);
+    return 1;
+}
+
+static int check_wchars(const char *s)
+{
+    wchar_t *w;
+    size_t n = utf8_to_wchars(NULL, s, (size_t)-1), result;
+    int failed;
+    w = (wchar_t *)malloc((n + 1) * sizeof(wchar_t));
+    if (w == NULL) return 1;
+    result = utf8_to_wchars(w, s, (size_t)-1);
+    failed = check("utf8_to_wchars", s, n, result);
+    free(w);
+    w = (wchar_t *)malloc((n == 0 ? 1 : n) * sizeof(wchar_t));
+    if (w == NULL) return 1;
+    result = utf8_to_wchars_n(w, s, strlen(s), (size_t)-1, NULL);
+    failed += check("utf8_to_wchars_n", s, n, result);
+    free(w);
+    return failed;
+}
+
+static int check_runes(const char *s)
+{
+    int32_t *runes;
+    size_t n = utf8_decode_runes(NULL, s, strlen(s), NULL), result;
+    int failed;
+    runes = (int32_t *)malloc((n == 0 ? 1 : n) * sizeof(int32_t));
+    if (runes == NULL) return 1;
+    result = utf8_decode_runes(runes, s, strlen(s), NULL);
+    failed = check("utf8_decode_runes", s, n, result);
+    free(runes);
+    return failed;
+}
+
+static int check_utf16(const char *s)
+{
+    uint16_t *units;
+    char *r;
+    size_t n = utf8_to_utf16(NULL, s, strlen(s), (size_t)-1, NULL), result;
+    int failed;
+    units = (uint16_t *)malloc((n == 0 ? 1 : n) * sizeof(uint16_t));
+    if (units == NULL) return 1;
+    result = utf8_to_utf16(units, s, strlen(s), (size_t)-1, NULL);
+    failed = check("utf8_to_utf16", s, n, result);
+    n = utf8_of_utf16(NULL, units, result, (size_t)-1, NULL);
+    failed += check("utf8_of_utf16 (NULL)", s, strlen(s), n);
+    r = (char *)malloc(n == 0 ? 1 : n);
+    if (r != NULL) {
+        result = utf8_of_utf16(r, units, result, (size_t)-1, NULL);
+        failed += check("utf8_of_utf16", s, n, result);
+        if (result == n && memcmp(r, s, n) != 0) {
+            printf("utf8_of_utf16: \"%s\" didn't round-trip.\n", s);
+            failed += 1;
+        }
+        free(r);
+    }
+    free(units);
+    return failed;
+}
+
+static int check_latin1(const char *s)
+{
+    char *latin1, *r;
+    size_t n = utf8_to_latin1(NULL, s, strlen(s), (size_t)-1, NULL, '?');
+    size_t result;
+    int failed;
+    latin1 = (char *)malloc(n == 0 ? 1 : n);
+    if (latin1 == NULL) return 1;
+    result = utf8_to_latin1(latin1, s, strlen(s), (size_t)-1, NULL, '?');
+    failed = check("utf8_to_latin1", s, n, result);
+    n = utf8_of_latin1(NULL, latin1, result, (size_t)-1, NULL);
+    r = (char *)malloc(n == 0 ? 1 : n);
+    if (r != NULL) {
+        result = utf8_of_latin1(r, latin1, result, (size_t)-1, NULL);
+        failed += check("utf8_of_latin1", s, n, result);
+        free(r);
+    }
+    free(latin1);
+    return failed;
+}
+
+int main(void)
+{
+    char s[4 * 100 + 1];
+    size_t n_pieces;
+    unsigned n;
+    int i, failed = 0;
+    for (n = 1; n <= sizeof(pieces) / sizeof(*pieces); n++) {
+        for (n_pieces = 1; n_pieces <= 100; n_pieces++) {
+            for (i = 0; i < 8; i++) {
+                make_string(s, n_pieces, n);
+                failed += check_wchars(s);
+                failed += check_runes(s);
+                failed += check_utf16(s);
+                failed += check_latin1(s);
+            }
+        }
+    }
+    /* the SIMD and the scalar paths can't disagree on the replacement */
+    if (utf8_to_latin1(NULL, "a", 1, 1, NULL, 0x13f) != 0) {
+        puts("utf8_to_latin1 accepted a replacement above 0xff.");
+        failed += 1;
+    }
+    /* an escaped terminator ends the zero-terminated string */
+    failed += check("utf8_of_ascii", "ab\\x00cd", 2,
+        utf8_of_ascii(NULL, "ab\\x00cd", (size_t)-1));
+    failed += check("utf8_of_ascii", "ab\\u0000cd\xff", 2,
+        utf8_of_ascii(NULL, "ab\\u0000cd\xff", (size_t)-1));
+    if (failed == 0) puts("All the sizes match.");
+    return failed;
+}
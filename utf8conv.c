@@ -0,0 +1,592 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L /* posix_memalign and clock_gettime */
+#endif
+
+#if !defined(_WIN32) && defined(__GNUC__)
+#define UTF8CONV_PIPELINE /* POSIX threads and the __atomic builtins */
+#endif
+
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <malloc.h>
+#define sys_write(fd, p, n) _write((fd), (p), (unsigned int)(n))
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define sys_write(fd, p, n) write((fd), (p), (n))
+#endif
+
+#if defined(UTF8CONV_PIPELINE)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "utf8.h"
+
+/*
+Validates or converts a file with the bulk functions of the library:
+
+    utf8conv [-v] [-j threads] mode [input [output]]
+
+The modes are `validate`, `to-wchars` and `of-wchars` (UTF-8 to and from
+the wide characters of the platform), `to-local` and `of-local` (to and
+from the encoding of the current locale) and `of-ascii` (ASCII with `\u`
+escapes to UTF-8). The input is mapped in memory when it's a regular file,
+so it's never copied, and the output is written from a large aligned
+buffer. The input and the output are the standard streams when missing or
+"-". An input which can't be mapped (a pipe, a terminal...) is streamed
+through three threads: one reads blocks, one converts them and one writes
+the output. With `-v` the sizes and the throughput are written to the 
+standard error stream. With `-j`, `to-wchars` converts with several threads.
+The exit status is 1 if the input isn't valid, 2 for the other errors.
+*/
+
+#define OUTPUT_SIZE (4 << 20) /* the size of the output buffer */
+#define OUTPUT_ALIGN 4096
+#define BLOCK_SIZE (1 << 20) /* the size of the blocks read from a stream */
+#define RING_SIZE 4 /* the number of blocks between two threads */
+#define CARRY_SIZE 16 /* the longest sequence which may be cut by a block */
+
+enum { VALIDATE, TO_WCHARS, OF_WCHARS, TO_LOCAL, OF_LOCAL, OF_ASCII };
+
+static const char *mode_names[] = {
+    "validate", "to-wchars", "of-wchars", "to-local", "of-local", "of-ascii"
+};
+
+struct input {
+    const char *data; /* NULL if the input is streamed from `fd` */
+    size_t size;
+    int mapped; /* `data` is a mapping of the file, not a copy */
+    int fd;
+};
+
+/* Reads the whole stream `file`, which can't be mapped. */
+static int read_input(FILE *file, struct input *input)
+{
+    size_t got, capacity = 1 << 20;
+    char *data = malloc(capacity), *more;
+    input->size = 0;
+    while (data != NULL) {
+        got = fread(data + input->size, 1, capacity - input->size, file);
+        input->size += got;
+        if (input->size < capacity) break;
+        more = realloc(data, capacity * 2);
+        if (more == NULL) free(data);
+        data = more;
+        capacity *= 2;
+    }
+    if (data == NULL || ferror(file)) {
+        free(data);
+        return -1;
+    }
+    input->data = data;
+    input->mapped = 0;
+    input->fd = -1;
+    return 0;
+}
+
+static int open_input(const char *name, struct input *input)
+{
+    FILE *file = stdin;
+    int result;
+#if !defined(_WIN32)
+    struct stat info;
+    void *data;
+    int fd = name == NULL ? 0 : open(name, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            /* the input is read once, from the start to the end */
+            posix_madvise(data, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+            input->data = data;
+            input->size = (size_t)info.st_size;
+            input->mapped = 1;
+            input->fd = -1;
+            if (fd != 0) close(fd);
+            return 0;
+        }
+    }
+#if defined(UTF8CONV_PIPELINE)
+    input->data = NULL;
+    input->size = 0;
+    input->mapped = 0;
+    input->fd = fd;
+    return 0;
+#endif
+    if (fd != 0) {
+        file = fdopen(fd, "rb");
+        if (file == NULL) {
+            close(fd);
+            return -1;
+        }
+    }
+#else
+    if (name != NULL) file = fopen(name, "rb");
+    else _setmode(_fileno(stdin), _O_BINARY);
+    if (file == NULL) return -1;
+#endif
+    result = read_input(file, input);
+    if (file != stdin) fclose(file);
+    return result;
+}
+
+static void close_input(struct input *input)
+{
+#if !defined(_WIN32)
+    if (input->mapped) {
+        munmap((void *)input->data, input->size);
+        return;
+    }
+    if (input->data == NULL && input->fd != 0) close(input->fd);
+#endif
+    free((void *)input->data);
+}
+
+static char *alloc_output(void)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(OUTPUT_SIZE, OUTPUT_ALIGN);
+#else
+    void *p;
+    return posix_memalign(&p, OUTPUT_ALIGN, OUTPUT_SIZE) == 0 ? p : NULL;
+#endif
+}
+
+static void free_output(char *p)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static int put(int fd, const char *p, size_t n)
+{
+    size_t done = 0, put;
+    while (done < n) {
+        put = (size_t)sys_write(fd, p + done, n - done);
+        if (put == (size_t)-1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += put;
+    }
+    return 0;
+}
+
+/*
+Converts at most `n_bytes` input bytes at `s` in at most `size` bytes at
+`buffer`, storing in `used` the number of input bytes converted. Returns the
+number of output bytes, or (size_t)-1 at an invalid or incomplete sequence,
+`used` receiving its offset.
+*/
+static size_t convert(int mode, const utf8_local_conv *conv, int n_threads,
+    char *buffer, size_t size, const char *s, size_t n_bytes, size_t *used)
+{
+    size_t done = (size_t)-1;
+    switch (mode) {
+    case VALIDATE:
+        *used = utf8_validate(s, n_bytes);
+        done = 0;
+        if (*used < n_bytes) {
+            errno = EILSEQ;
+            done = (size_t)-1;
+        }
+        break;
+    case TO_WCHARS:
+        done = utf8_to_wchars_parallel((wchar_t *)buffer, s, n_bytes,
+            size / sizeof(wchar_t), used, (unsigned)n_threads);
+        if (done != (size_t)-1) done *= sizeof(wchar_t);
+        break;
+    case OF_WCHARS:
+        /* the input is aligned, the offsets are multiples of wchar_t */
+        done = utf8_of_wchars_n(buffer, (const wchar_t *)s,
+            n_bytes / sizeof(wchar_t), size, used);
+        *used *= sizeof(wchar_t);
+        if (done != (size_t)-1 && n_bytes < sizeof(wchar_t)) {
+            errno = EILSEQ; /* incomplete wide character */
+            done = (size_t)-1;
+        }
+        break;
+    case TO_LOCAL:
+        done = utf8_to_local_conv(conv, buffer, s, n_bytes, size, used);
+        break;
+    case OF_LOCAL:
+        done = utf8_of_local_conv(conv, buffer, s, n_bytes, size, used);
+        break;
+    case OF_ASCII:
+        done = utf8_of_ascii_n(buffer, s, n_bytes, size, used);
+        break;
+    }
+    return done;
+}
+
+#if defined(UTF8CONV_PIPELINE)
+
+/*
+The stages of the pipeline hand the blocks over through rings with a single
+producer and a single consumer. The producer fills the slot at `head`, then
+publishes it by incrementing `head`; the consumer empties the slot at
+`tail`, then gives it back by incrementing `tail`. Each index is written by
+one thread only, so the rings need no lock.
+*/
+
+struct block {
+    char *data;
+    size_t size;
+    int last; /* the last block of the stream */
+};
+
+struct ring {
+    struct block slots[RING_SIZE];
+    size_t head;
+    size_t tail;
+};
+
+struct pipeline {
+    struct ring blocks; /* the blocks read, to be converted */
+    struct ring output; /* the blocks converted, to be written */
+    int input;
+    int output_fd;
+    int stop; /* set when the writer fails */
+    int read_error;
+    int write_error;
+};
+
+static void backoff(unsigned *spins)
+{
+    struct timespec pause = {0, 50000};
+    /* a stage waiting for the system sleeps instead of spinning */
+    if (++*spins < 64) sched_yield();
+    else nanosleep(&pause, NULL);
+}
+
+/* Returns the slot to fill, or NULL if the pipeline stops. */
+static struct block *ring_put_begin(struct ring *ring, int *stop)
+{
+    unsigned spins = 0;
+    while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) 
+        == RING_SIZE) {
+        if (__atomic_load_n(stop, __ATOMIC_ACQUIRE)) return NULL;
+        backoff(&spins);
+    }
+    return ring->slots + ring->head % RING_SIZE;
+}
+
+static void ring_put_end(struct ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the slot to empty, or NULL if the pipeline stops. */
+static struct block *ring_get_begin(struct ring *ring, int *stop)
+{
+    unsigned spins = 0;
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+        if (__atomic_load_n(stop, __ATOMIC_ACQUIRE)) return NULL;
+        backoff(&spins);
+    }
+    return ring->slots + ring->tail % RING_SIZE;
+}
+
+static void ring_get_end(struct ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *read_blocks(void *arg)
+{
+    struct pipeline *p = arg;
+    struct block *block;
+    ssize_t got;
+    int last = 0;
+    while (!last) {
+        block = ring_put_begin(&p->blocks, &p->stop);
+        if (block == NULL) break;
+        block->size = 0;
+        /* the blocks hold whole wide characters, so they stay aligned */
+        do {
+            got = read(p->input, block->data + CARRY_SIZE + block->size,
+                BLOCK_SIZE - block->size);
+            if (got > 0) block->size += (size_t)got;
+            else if (got == 0) last = 1;
+            else if (errno != EINTR) {
+                p->read_error = errno;
+                last = 1;
+            }
+        } while (!last && block->size % sizeof(wchar_t) != 0);
+        block->last = last;
+        ring_put_end(&p->blocks);
+    }
+    return NULL;
+}
+
+static void *write_blocks(void *arg)
+{
+    struct pipeline *p = arg;
+    struct block *block;
+    int last = 0;
+    while (!last) {
+        block = ring_get_begin(&p->output, &p->stop);
+        if (block == NULL) break;
+        last = block->last;
+        if (put(p->output_fd, block->data, block->size) != 0) {
+            p->write_error = errno;
+            __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+            last = 1;
+        }
+        ring_get_end(&p->output);
+    }
+    return NULL;
+}
+
+/*
+Converts the blocks read into output blocks. A sequence cut at the end of a
+block is carried over to the start of the next one, in front of its data.
+Returns the exit status, storing in `used` the number of input bytes 
+converted and in `n_output` the number of output bytes.
+*/
+static int convert_blocks(struct pipeline *p, int mode,
+    const utf8_local_conv *conv, int n_threads, size_t *used,
+    size_t *n_output)
+{
+    struct block *block, *out = NULL;
+    char carry[CARRY_SIZE], *s;
+    size_t n_carry = 0, n_bytes, parsed, done;
+    int last = 0, status = 0;
+    while (!last && status == 0) {
+        block = ring_get_begin(&p->blocks, &p->stop);
+        if (block == NULL) return 2;
+        last = block->last;
+        s = block->data + CARRY_SIZE - n_carry;
+        memcpy(s, carry, n_carry);
+        n_bytes = n_carry + block->size;
+        n_carry = 0;
+        while (n_bytes > 0 && status == 0) {
+            if (out == NULL) {
+                out = ring_put_begin(&p->output, &p->stop);
+                if (out == NULL) return 2;
+                out->size = 0;
+                out->last = 0;
+            }
+            done = convert(mode, conv, n_threads, out->data + out->size,
+                OUTPUT_SIZE - out->size, s, n_bytes, &parsed);
+            if (done == (size_t)-1) {
+                done = parsed > 0 ? convert(mode, conv, n_threads, 
+                    out->data + out->size, OUTPUT_SIZE - out->size, s, 
+                    parsed, &parsed) : 0;
+                if (!last && n_bytes - parsed < CARRY_SIZE) {
+                    n_carry = n_bytes - parsed;
+                    memcpy(carry, s + parsed, n_carry);
+                }
+                else status = 1;
+            }
+            out->size += done;
+            *used += parsed;
+            s += parsed;
+            n_bytes -= parsed + n_carry;
+            if (n_bytes > 0 && status == 0) {
+                if (parsed == 0 && out->size == 0) status = 1;
+                else { /* the output block is full */
+                    ring_put_end(&p->output);
+                    out = NULL;
+                }
+            }
+        }
+        ring_get_end(&p->blocks);
+        if (out == NULL && (last || status != 0)) {
+            out = ring_put_begin(&p->output, &p->stop);
+            if (out == NULL) return 2;
+            out->size = 0;
+        }
+        if (out != NULL && (out->size > 0 || last || status != 0)) {
+            *n_output += out->size;
+            out->last = last || status != 0;
+            ring_put_end(&p->output);
+            out = NULL;
+        }
+    }
+    return status;
+}
+
+/*
+Converts the stream `input` to `output` with a thread reading, the calling
+thread converting and a thread writing. Returns the exit status.
+*/
+static int run_pipeline(int input, int output, int mode,
+    const utf8_local_conv *conv, int n_threads, size_t *used,
+    size_t *n_output)
+{
+    static struct pipeline p;
+    pthread_t reader, writer;
+    int i, status = 2;
+    memset(&p, 0, sizeof(p));
+    p.input = input;
+    p.output_fd = output;
+    for (i = 0; i < RING_SIZE; i++) {
+        p.blocks.slots[i].data = malloc(CARRY_SIZE + BLOCK_SIZE);
+        p.output.slots[i].data = alloc_output();
+        if (p.blocks.slots[i].data == NULL || p.output.slots[i].data == NULL)
+            break;
+    }
+    if (i == RING_SIZE && pthread_create(&reader, NULL, read_blocks, &p) == 0)
+    {
+        if (pthread_create(&writer, NULL, write_blocks, &p) == 0) {
+            status = convert_blocks(&p, mode, conv, n_threads, used, 
+                n_output);
+            pthread_join(writer, NULL);
+        }
+        if (status != 0) { /* the reader may wait for the input */
+            __atomic_store_n(&p.stop, 1, __ATOMIC_RELEASE);
+            pthread_cancel(reader);
+        }
+        pthread_join(reader, NULL);
+    }
+    for (i = 0; i < RING_SIZE; i++) {
+        free(p.blocks.slots[i].data);
+        free_output(p.output.slots[i].data);
+    }
+    if (p.read_error != 0) {
+        fprintf(stderr, "Can't read the input: %s.\n",
+            strerror(p.read_error));
+        status = 2;
+    }
+    if (p.write_error != 0) {
+        fprintf(stderr, "Can't write the output: %s.\n",
+            strerror(p.write_error));
+        status = 2;
+    }
+    if (status == 2 && p.read_error == 0 && p.write_error == 0)
+        fprintf(stderr, "Can't start the pipeline.\n");
+    return status;
+}
+
+#endif
+
+
+static double now(void)
+{
+#if defined(_WIN32)
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: utf8conv [-v] [-j threads] mode "
+        "[input [output]]\nThe modes are validate, to-wchars, of-wchars, "
+        "to-local, of-local and of-ascii.\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct input input;
+    utf8_local_conv *conv = NULL;
+    const char *input_name = NULL, *output_name = NULL;
+    char *buffer = NULL;
+    size_t used = 0, parsed, done, n_output = 0;
+    int i = 1, mode, verbose = 0, n_threads = 1, output = 1, status = 0;
+    double start, seconds;
+    setlocale(LC_ALL, "");
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+        if (strcmp(argv[i], "-v") == 0) verbose = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            n_threads = atoi(argv[++i]);
+        else break;
+    }
+    for (mode = VALIDATE; mode <= OF_ASCII && i < argc; mode++) {
+        if (strcmp(argv[i], mode_names[mode]) == 0) break;
+    }
+    if (i >= argc || mode > OF_ASCII || argc - i > 3) {
+        usage();
+        return 2;
+    }
+    if (i + 1 < argc && strcmp(argv[i + 1], "-") != 0)
+        input_name = argv[i + 1];
+    if (i + 2 < argc && strcmp(argv[i + 2], "-") != 0)
+        output_name = argv[i + 2];
+    if (open_input(input_name, &input) != 0) {
+        fprintf(stderr, "Can't read \"%s\".\n",
+            input_name == NULL ? "<stdin>" : input_name);
+        return 2;
+    }
+    if (mode == TO_LOCAL || mode == OF_LOCAL) {
+        conv = utf8_local_conv_open(NULL);
+        if (conv == NULL) {
+            fprintf(stderr, "Can't convert in the current locale.\n");
+            status = 2;
+        }
+    }
+    if (mode != VALIDATE && status == 0) {
+        if (input.data != NULL) buffer = alloc_output();
+        if (output_name != NULL)
+            output = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#if defined(_WIN32)
+        else _setmode(1, _O_BINARY);
+#endif
+        if ((buffer == NULL && input.data != NULL) || output < 0) {
+            fprintf(stderr, "Can't write \"%s\".\n",
+                output_name == NULL ? "<stdout>" : output_name);
+            status = 2;
+        }
+    }
+    start = now();
+#if defined(UTF8CONV_PIPELINE)
+    if (input.data == NULL && status == 0)
+        status = run_pipeline(input.fd, output, mode, conv, n_threads, &used,
+            &n_output);
+#endif
+    while (status == 0 && used < input.size) {
+        done = convert(mode, conv, n_threads, buffer, OUTPUT_SIZE,
+            input.data + used, input.size - used, &parsed);
+        if (done == (size_t)-1) {
+            /* write what converts before the invalid sequence */
+            done = parsed > 0 ? convert(mode, conv, n_threads, buffer,
+                OUTPUT_SIZE, input.data + used, parsed, &parsed) : 0;
+            status = 1;
+        }
+        if (done != (size_t)-1 && put(output, buffer, done) != 0) {
+            fprintf(stderr, "Can't write the output: %s.\n",
+                strerror(errno));
+            status = 2;
+        }
+        if (done != (size_t)-1) n_output += done;
+        used += parsed;
+        if (done == 0 && parsed == 0) status = 1; /* doesn't progress */
+    }
+    seconds = now() - start;
+    if (status == 1) {
+        fprintf(stderr, "The input isn't valid at the byte offset %zu.\n",
+            used);
+        if (mode == VALIDATE) printf("invalid at %zu\n", used);
+    }
+    else if (status == 0 && mode == VALIDATE)
+        printf("valid, %zu bytes\n", used);
+    if (verbose) {
+        fprintf(stderr, "%s: %zu bytes read%s, %zu bytes written, "
+            "%.3f s, %.1f MB/s\n", mode_names[mode], used,
+            input.mapped ? " (mapped)" : input.data == NULL ? " (streamed)" 
+            : "", n_output, seconds, seconds > 0 ? used / seconds / 1e6 : 0);
+    }
+    if (output_name != NULL && output >= 0) close(output);
+    free_output(buffer);
+    utf8_local_conv_close(conv);
+    close_input(&input);
+    return status;
+}